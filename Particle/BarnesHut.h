@@ -1,22 +1,52 @@
 #pragma once
 
+#include "NodeArena.h"
 #include "Particle.h"
+#include "TraversalStats.h"
 #include "Vector.h"
 #include "utils.h"
 
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <exception>
 #include <format>
 #include <iostream>
+#include <span>
 #include <vector>
 
+// Two particles that touched during a parallel force walk, a collision changes both so it is resolved afterwards
+struct Collision {
+        Particle* particle;
+        Particle* other;
+};
+
+// On one thread, in the order of the list. Pairs with a particle merged by an earlier pair are skipped and not counted.
+inline void resolveCollisions(std::span<const Collision> collisions) {
+    for (const Collision& collision : collisions) {
+        const bool wasEnabled = collision.particle->isEnabled() and collision.other->isEnabled();
+        collision.particle->collide(*collision.other);
+
+        if constexpr (TraversalCounters::enabled) {
+            if (wasEnabled) {
+                TraversalCounters::local().collisions++;
+                if (!collision.other->isEnabled()) {
+                    TraversalCounters::local().merges++;
+                }
+            }
+        }
+    }
+}
+
 struct Node {
         Position from;
         Position to;
         Position accumulatedCenterOfMass;
         double mass = 0;
+        uint32_t count = 0; // Particles inside of this cell
+        bool remote = false; // The particle of this leaf is owned by another process, it only attracts
 
-        std::array<size_t, 8> children{0};
+        std::array<Node*, 8> children{};
         Particle* particle = nullptr;
 
         constexpr Node(const Position& from, const Position& to) :
@@ -29,12 +59,16 @@ struct Node {
             return (to.x - from.x) * math::invsqrtQuake((centerOfMass() - p).lengthSquared()); // worth?
         }
 
+        double exactInfluence(const Position& p) const {
+            return (to.x - from.x) / math::distance(centerOfMass(), p);
+        }
+
         constexpr Position centerOfMass() const {
             return accumulatedCenterOfMass / mass;
         }
 
         constexpr bool isLeaf() const {
-            return children.front() == 0;
+            return children.front() == nullptr;
         }
 
         std::string toString() const {
@@ -48,128 +82,221 @@ struct Node {
             return in_x and in_y and in_z;
         }
 
-        size_t getChildIndex(const Position& pos) {
+        Node* getChild(const Position& pos) const {
             const Position relativeParticlePos = pos - from;
             const Vector3d childCellSize = (to - from) / 2;
             const Position coords = (relativeParticlePos / childCellSize); // x, y, z [0;2[,[0;2[,[0;2[
             const int index = static_cast<int>(coords.x) + (static_cast<int>(coords.y) * 2) + (static_cast<int>(coords.z) * 4);
-            const size_t childIndex = children[index];
+            Node* child = children[index];
 
             assert(isInCell(pos));
-            return childIndex;
+            return child;
         }
 };
 
 class BarnesHut {
-        static constexpr double influenceThreshold = 0.5; // 0.5 is common value across multiple papers
         static constexpr bool withCollision = true;
 
     public:
-        BarnesHut(const Position& from, const Position& to) {
-            _nodes.emplace_back(from, to);
+        BarnesHut(const Position& from, const Position& to) :
+                _from(from),
+                _to(to) {
+            resetCalculation();
         }
 
-        constexpr void insertParticles(std::vector<Particle>& particles) {
-            if (_nodes.capacity() < (particles.size() * 2)) {
-                _nodes.reserve(particles.size() * 2);
-            }
+        // Parents point to their children, a copy would point into the arena of the original
+        BarnesHut(const BarnesHut&) = delete;
+        BarnesHut& operator=(const BarnesHut&) = delete;
 
+        // Adds to whatever is in the tree already, resetCalculation starts over
+        constexpr void insertParticles(std::span<Particle> particles, bool remote = false) {
             for (Particle& p : particles) {
                 if (!p.isEnabled()) {
                     continue;
                 }
 
-                if (_nodes[0].isInCell(p.position())) {
-                    insert(0, p);
+                if (_root->isInCell(p.position())) {
+                    insert(_root, p, remote);
                 }
             }
         }
 
-        void calculateAcceleration(Particle& p) const {
+        /*
+         * Returns the visited cells, a measure of the work spent on this particle.
+         * With a list the collisions are only added to it, so other particles are not written while other threads read them.
+         */
+        size_t calculateAcceleration(Particle& p, std::vector<Collision>* collisions = nullptr) const {
             if (!p.isEnabled()) {
-                return;
+                return 0;
             }
-            calculateAcceleration(0, p);
+            return calculateAcceleration(*_root, p, collisions);
+        }
+
+        // Opening angle theta, cells with a smaller influence are used as a whole
+        void setInfluenceThreshold(double threshold) {
+            _influenceThreshold = threshold;
         }
 
+        double getInfluenceThreshold() const {
+            return _influenceThreshold;
+        }
+
+        // Exact distances to decide whether a cell is opened instead of the one step inverse square root approximation
+        void setExactInfluence(bool exact) {
+            _exactInfluence = exact;
+        }
+
+        bool isExactInfluence() const {
+            return _exactInfluence;
+        }
+
+        // Drops all nodes at once, their memory is reused by the next build
         void resetCalculation() {
-            _nodes.erase(_nodes.begin() + 1, _nodes.end());
-            _nodes.front().accumulatedCenterOfMass = Position(0.0, 0.0, 0.0);
-            _nodes.front().accumulatedCenterOfMass = Position(0.0, 0.0, 0.0);
-            _nodes.front().mass = 0.0;
-            _nodes.front().particle = nullptr;
-
-            for (size_t& index : _nodes.front().children) {
-                index = 0;
-            }
+            _arena.reset();
+            _nodeCount.store(0, std::memory_order_relaxed);
+            _root = createNode(_from, _to);
+        }
+
+        /*
+         * Depth first walk over all non-empty cells, starting at the root.
+         * The visitor returns whether the children of the given node should be visited too.
+         */
+        template <typename Visitor>
+        void traverse(Visitor&& visit) const {
+            traverse(*_root, visit);
+        }
+
+        // Adds the shape of the tree: node count, capacity and leaf depths
+        void collectStats(TraversalStats& stats) const {
+            stats.nodeCount = _nodeCount.load(std::memory_order_relaxed);
+            stats.nodeCapacity = _arena.capacity();
+            collectLeafDepths(*_root, 0, stats);
         }
 
     private:
-        std::vector<Node> _nodes;
+        Position _from;
+        Position _to;
+        NodeArena<Node> _arena; // Nodes keep their address until the next reset
+        Node* _root = nullptr;
+        std::atomic<size_t> _nodeCount{0};
+        double _influenceThreshold = 0.5; // 0.5 is common value across multiple papers
+        bool _exactInfluence = false;
+
+        template <typename Visitor>
+        void traverse(const Node& node, Visitor& visit) const {
+            if (node.count == 0) {
+                return;
+            }
 
-        constexpr void insert(size_t index, Particle& p) {
-            Node* currentNode = &_nodes[index];
+            if (visit(node) and !node.isLeaf()) {
+                for (const Node* child : node.children) {
+                    traverse(*child, visit);
+                }
+            }
+        }
 
+        constexpr void insert(Node* currentNode, Particle& p, bool remote) {
             assert(currentNode->isInCell(p.position()));
             if (currentNode->isLeaf()) {
                 if (currentNode->particle == nullptr) {
                     currentNode->particle = &p;
+                    currentNode->remote = remote;
+                    currentNode->count = 1;
                 } else {
-                    initializeChildrenForNode(index);
-                    currentNode = &_nodes[index];
-
-                    const size_t firstChildIndex = currentNode->getChildIndex(currentNode->particle->position());
-                    const size_t secondChildIndex = currentNode->getChildIndex(p.position());
+                    initializeChildrenForNode(*currentNode);
 
-                    insert(firstChildIndex, *currentNode->particle);
-                    insert(secondChildIndex, p);
-                    currentNode = &_nodes[index];
+                    insert(currentNode->getChild(currentNode->particle->position()), *currentNode->particle, currentNode->remote);
+                    insert(currentNode->getChild(p.position()), p, remote);
 
                     currentNode->mass = p.mass() + currentNode->particle->mass();
                     currentNode->accumulatedCenterOfMass = p.toForce() + currentNode->particle->toForce();
+                    currentNode->count = 2;
                     currentNode->particle = nullptr;
+                    currentNode->remote = false;
                 }
             } else {
-                const size_t childIndex = currentNode->getChildIndex(p.position());
+                Node* child = currentNode->getChild(p.position());
                 currentNode->mass += p.mass();
                 currentNode->accumulatedCenterOfMass += p.toForce();
+                currentNode->count++;
 
-                insert(childIndex, p);
+                insert(child, p, remote);
             }
         }
 
-        constexpr void calculateAcceleration(size_t index, Particle& p) const {
-            const Node& currentNode = _nodes[index];
-
+        constexpr size_t calculateAcceleration(const Node& currentNode, Particle& p, std::vector<Collision>* collisions) const {
             if ((currentNode.mass == 0.0) and (currentNode.particle == nullptr)) {
-                return;
+                return 0;
+            }
+
+            if constexpr (TraversalCounters::enabled) {
+                TraversalCounters::local().nodesVisited++;
             }
 
             if (currentNode.isLeaf()) {
                 if (&p != currentNode.particle) {
                     const double distance = math::distance(p.position(), currentNode.particle->position());
 
-                    if (distance > (p.radius() + currentNode.particle->radius())) {
+                    if (currentNode.remote or (distance > (p.radius() + currentNode.particle->radius()))) {
                         p.accelerate(currentNode.particle->position(), currentNode.particle->mass());
+
+                        if constexpr (TraversalCounters::enabled) {
+                            TraversalCounters::local().particleInteractions++;
+                        }
                     } else {
                         if constexpr (withCollision) {
-                            p.collide(*currentNode.particle);
-                            // re-insert particle?
+                            if (collisions != nullptr) {
+                                collisions->emplace_back(&p, currentNode.particle); // Counted once resolved
+                            } else {
+                                // A particle merged earlier in this step stays in the tree, touching it again is no collision
+                                const bool wasEnabled = p.isEnabled() and currentNode.particle->isEnabled();
+                                p.collide(*currentNode.particle);
+                                // re-insert particle?
+
+                                if constexpr (TraversalCounters::enabled) {
+                                    if (wasEnabled) {
+                                        TraversalCounters::local().collisions++;
+                                        if (!currentNode.particle->isEnabled()) {
+                                            TraversalCounters::local().merges++;
+                                        }
+                                    }
+                                }
+                            }
                         }
                     }
                 }
-            } else if (currentNode.influence(p.position()) < influenceThreshold) {
+            } else if ((_exactInfluence ? currentNode.exactInfluence(p.position()) : currentNode.influence(p.position())) < _influenceThreshold) {
                 p.accelerate(currentNode.centerOfMass(), currentNode.mass);
+
+                if constexpr (TraversalCounters::enabled) {
+                    TraversalCounters::local().nodeInteractions++;
+                }
             } else {
-                for (size_t childIndex : currentNode.children) {
-                    calculateAcceleration(childIndex, p);
+                size_t visited = 1;
+                for (const Node* child : currentNode.children) {
+                    visited += calculateAcceleration(*child, p, collisions);
                 }
+                return visited;
             }
+            return 1;
         }
 
-        constexpr void initializeChildrenForNode(size_t index) {
-            const Position from = _nodes[index].from;
-            const Position to = _nodes[index].to;
+        void collectLeafDepths(const Node& node, size_t depth, TraversalStats& stats) const {
+            if (node.isLeaf()) {
+                if (node.particle != nullptr) {
+                    stats.leafDepthHistogram[std::min(depth, TraversalStats::maxDepth - 1)]++;
+                }
+                return;
+            }
+
+            for (const Node* child : node.children) {
+                collectLeafDepths(*child, depth + 1, stats);
+            }
+        }
+
+        void initializeChildrenForNode(Node& node) {
+            const Position from = node.from;
+            const Position to = node.to;
 
             const Position half_cell((to - from) / 2);
             const Position center(half_cell + from);
@@ -179,19 +306,18 @@ class BarnesHut {
             const Position along_z(0.0, 0.0, half_cell.z);
 
             // Order important, index to find child is calculated
-            _nodes[index].children[0] = createNode(from, center);
-            _nodes[index].children[1] = createNode(from + along_x, center + along_x);
-            _nodes[index].children[2] = createNode(from + along_y, center + along_y);
-            _nodes[index].children[3] = createNode(from + along_x + along_y, center + along_x + along_y);
-            _nodes[index].children[4] = createNode(from + along_z, center + along_z);
-            _nodes[index].children[5] = createNode(from + along_x + along_z, center + along_x + along_z);
-            _nodes[index].children[6] = createNode(from + along_y + along_z, center + along_y + along_z);
-            _nodes[index].children[7] = createNode(center, to);
-        }
-
-        constexpr size_t createNode(const Position& from, const Position& to) {
-            const size_t childIndex = _nodes.size();
-            _nodes.emplace_back(from, to);
-            return childIndex;
+            node.children[0] = createNode(from, center);
+            node.children[1] = createNode(from + along_x, center + along_x);
+            node.children[2] = createNode(from + along_y, center + along_y);
+            node.children[3] = createNode(from + along_x + along_y, center + along_x + along_y);
+            node.children[4] = createNode(from + along_z, center + along_z);
+            node.children[5] = createNode(from + along_x + along_z, center + along_x + along_z);
+            node.children[6] = createNode(from + along_y + along_z, center + along_y + along_z);
+            node.children[7] = createNode(center, to);
+        }
+
+        Node* createNode(const Position& from, const Position& to) {
+            _nodeCount.fetch_add(1, std::memory_order_relaxed);
+            return _arena.create(from, to);
         }
 };
\ No newline at end of file
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <optional>
+
+/*
+ * Fixed capacity FIFO to hand work from the simulation thread to a background worker.
+ * The producer decides whether it wants to wait for space (push) or give up (tryPush).
+ */
+template <typename T>
+class BoundedQueue {
+    public:
+        explicit BoundedQueue(size_t capacity) :
+                _capacity(capacity) {
+        }
+
+        bool push(T value) {
+            std::unique_lock lock(_mutex);
+            _notFull.wait(lock, [this]() {
+                return _closed or (_queue.size() < _capacity);
+            });
+
+            if (_closed) {
+                return false;
+            }
+
+            _queue.push_back(std::move(value));
+            _notEmpty.notify_one();
+            return true;
+        }
+
+        bool tryPush(T& value) {
+            std::lock_guard lock(_mutex);
+            if (_closed or (_queue.size() >= _capacity)) {
+                return false;
+            }
+
+            _queue.push_back(std::move(value));
+            _notEmpty.notify_one();
+            return true;
+        }
+
+        std::optional<T> pop() {
+            std::unique_lock lock(_mutex);
+            _notEmpty.wait(lock, [this]() {
+                return _closed or !_queue.empty();
+            });
+
+            return takeFront();
+        }
+
+        std::optional<T> tryPop() {
+            std::lock_guard lock(_mutex);
+            return takeFront();
+        }
+
+        // Wakes up everybody waiting, remaining elements can still be popped
+        void close() {
+            std::lock_guard lock(_mutex);
+            _closed = true;
+            _notEmpty.notify_all();
+            _notFull.notify_all();
+        }
+
+        size_t size() const {
+            std::lock_guard lock(_mutex);
+            return _queue.size();
+        }
+
+    private:
+        const size_t _capacity;
+        std::deque<T> _queue;
+        bool _closed = false;
+
+        mutable std::mutex _mutex;
+        std::condition_variable _notEmpty;
+        std::condition_variable _notFull;
+
+        std::optional<T> takeFront() {
+            if (_queue.empty()) {
+                return std::nullopt;
+            }
+
+            T value = std::move(_queue.front());
+            _queue.pop_front();
+            _notFull.notify_one();
+            return value;
+        }
+};
\ No newline at end of file
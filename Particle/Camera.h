@@ -1,9 +1,15 @@
 #pragma once
 
+#include "Tensor.h"
 #include "Vector.h"
 #include "utils.h"
 
+#include <array>
 #include <limits>
+#include <span>
+
+// Rows map a world position to (screen x * w, screen y * w, w)
+using Matrix3x4 = std::array<std::array<double, 4>, 3>;
 
 class Camera {
     public:
@@ -13,20 +19,19 @@ class Camera {
                 _displaySurface(displaySurface),
                 _offset(offset),
                 _fov(math::degreesToRadians(fov)) {
+            updateView();
         }
 
         Vector3d turn(const Position& particle) const {
-            return rotate_x_axis(_turn.x, rotate_y_axis(_turn.y, particle));
+            return _rotation * particle;
         }
 
         Vector2d project(const Position& turnedPosition) const {
             const double screenParticleDelta = _displaySurface.z - turnedPosition.z;
-            const double f = 1 / std::tan(_fov / 2);
-            const double aspectRatio = _displaySurface.x / _displaySurface.y;
 
             Vector2d out;
-            out.x = (aspectRatio * f * turnedPosition.x) / screenParticleDelta;
-            out.y = (f * turnedPosition.y) / screenParticleDelta;
+            out.x = (_aspectRatio * _focalLength * turnedPosition.x) / screenParticleDelta;
+            out.y = (_focalLength * turnedPosition.y) / screenParticleDelta;
 
             out += 1.0;
             out *= 0.5;
@@ -40,14 +45,70 @@ class Camera {
             return out;
         }
 
+        /*
+         * Turns and projects a whole batch at once with the cached view-projection matrix.
+         * Branch free so the compiler can vectorize it, particles behind the display surface get a negative radius.
+         */
+        void projectAll(std::span<const double> x, std::span<const double> y, std::span<const double> z, std::span<const double> radius, std::span<double> screen_x, std::span<double> screen_y,
+            std::span<double> screenRadius) const {
+            const Matrix3x4& m = _viewProjection;
+            const double radiusFactor = _radiusFactor;
+
+            for (size_t i = 0; i < x.size(); i++) {
+                const double w = m[2][0] * x[i] + m[2][1] * y[i] + m[2][2] * z[i] + m[2][3];
+                const double invW = 1.0 / w;
+
+                screen_x[i] = (m[0][0] * x[i] + m[0][1] * y[i] + m[0][2] * z[i] + m[0][3]) * invW;
+                screen_y[i] = (m[1][0] * x[i] + m[1][1] * y[i] + m[1][2] * z[i] + m[1][3]) * invW;
+                screenRadius[i] = (w <= 0.0) ? -radius[i] * radiusFactor * invW : -1.0;
+            }
+        }
+
+        /*
+         * Conservative frustum test for an axis aligned box, false only if the box is certainly not on screen.
+         * Works in homogeneous coordinates, so corners behind the display surface need no special handling.
+         */
+        bool isBoxVisible(const Position& from, const Position& to, const Vector2d& screenSize, double pixelMargin = 0.0) const {
+            const Matrix3x4& m = _viewProjection;
+            // Bits for: behind, left, right, above, below
+            uint8_t outsideOfAll = 0b11111;
+
+            for (int corner = 0; corner < 8; corner++) {
+                const double x = (corner & 1) ? to.x : from.x;
+                const double y = (corner & 2) ? to.y : from.y;
+                const double z = (corner & 4) ? to.z : from.z;
+
+                const double w = m[2][0] * x + m[2][1] * y + m[2][2] * z + m[2][3];
+                const double sw_x = m[0][0] * x + m[0][1] * y + m[0][2] * z + m[0][3];
+                const double sw_y = m[1][0] * x + m[1][1] * y + m[1][2] * z + m[1][3];
+
+                // w is negative in front of the display surface, comparisons are flipped
+                uint8_t outside = 0;
+                outside |= (w > 0) ? 0b00001 : 0;
+                outside |= (sw_x > -pixelMargin * w) ? 0b00010 : 0;
+                outside |= (sw_x < (screenSize.x + pixelMargin) * w) ? 0b00100 : 0;
+                outside |= (sw_y > -pixelMargin * w) ? 0b01000 : 0;
+                outside |= (sw_y < (screenSize.y + pixelMargin) * w) ? 0b10000 : 0;
+
+                outsideOfAll &= outside;
+                if (outsideOfAll == 0) {
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
         void move(const Vector2d& direction) {
             _offset += direction;
+            updateView();
         }
 
         void zoom(double amount) {
             double newZ = _displaySurface.z + amount;
             if (newZ < 0) {
                 _displaySurface.z = newZ;
+                updateView();
             }
         }
 
@@ -83,12 +144,14 @@ class Camera {
 
         void turn(Vector2d direction) {
             _turn += direction;
+            updateView();
         }
 
         void reset() {
             _displaySurface = _displaySurface_org;
             _offset = _offset_org;
             _turn = {};
+            updateView();
         }
 
         const Vector3d& getDisplaySurface() const {
@@ -99,6 +162,11 @@ class Camera {
             return _fov;
         }
 
+        // Screen radius = radius * factor / distance to the display surface
+        double getRadiusFactor() const {
+            return _radiusFactor;
+        }
+
     private:
         const Vector3d _displaySurface_org;
         const Vector2d _offset_org;
@@ -107,4 +175,47 @@ class Camera {
         Vector2d _offset;
         Vector2d _turn;
         double _fov;
+
+        Tensor3d _rotation = Tensor3d({});
+        Matrix3x4 _viewProjection{};
+        double _focalLength = 1.0;
+        double _aspectRatio = 1.0;
+        double _radiusFactor = 1.0;
+
+        // The only place with trigonometry, called whenever the camera changes
+        void updateView() {
+            const Vector3d column_x = rotate_x_axis(_turn.x, rotate_y_axis(_turn.y, Vector3d(1.0, 0.0, 0.0)));
+            const Vector3d column_y = rotate_x_axis(_turn.x, rotate_y_axis(_turn.y, Vector3d(0.0, 1.0, 0.0)));
+            const Vector3d column_z = rotate_x_axis(_turn.x, rotate_y_axis(_turn.y, Vector3d(0.0, 0.0, 1.0)));
+            _rotation = Tensor3d({
+                {
+                 {column_x.x, column_y.x, column_z.x},
+                 {column_x.y, column_y.y, column_z.y},
+                 {column_x.z, column_y.z, column_z.z},
+                 }
+            });
+
+            _focalLength = 1 / std::tan(_fov / 2);
+            _aspectRatio = _displaySurface.x / _displaySurface.y;
+            _radiusFactor = 500 * std::tan(_fov / 2);
+
+            // screen = ((scale * turned) / w + 1) / 2 * surface + offset with w = surface.z - turned.z
+            const double scale_x = 0.5 * _displaySurface.x * _aspectRatio * _focalLength;
+            const double scale_y = 0.5 * _displaySurface.y * _focalLength;
+            const double center_x = 0.5 * _displaySurface.x + _offset.x;
+            const double center_y = 0.5 * _displaySurface.y + _offset.y;
+
+            for (size_t column = 0; column < 3; column++) {
+                const double turned_x = _rotation.get(0, column);
+                const double turned_y = _rotation.get(1, column);
+                const double turned_z = _rotation.get(2, column);
+
+                _viewProjection[0][column] = scale_x * turned_x - center_x * turned_z;
+                _viewProjection[1][column] = scale_y * turned_y - center_y * turned_z;
+                _viewProjection[2][column] = -turned_z;
+            }
+            _viewProjection[0][3] = center_x * _displaySurface.z;
+            _viewProjection[1][3] = center_y * _displaySurface.z;
+            _viewProjection[2][3] = _displaySurface.z;
+        }
 };
\ No newline at end of file
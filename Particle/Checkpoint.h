@@ -0,0 +1,259 @@
+#pragma once
+
+#include "MappedFile.h"
+#include "Particle.h"
+#include "Vector.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <format>
+#include <span>
+#include <stdexcept>
+#include <vector>
+
+#ifdef _WIN32
+#include <fstream>
+#else
+#include <climits>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+enum class CheckpointBlock {
+    Position,
+    Velocity,
+    Spin,
+    Mass,
+    Flags,
+    Count
+};
+
+enum CheckpointFlags : uint8_t {
+    ParticleEnabled = 1 << 0,
+};
+
+struct CheckpointHeader {
+        static constexpr std::array<char, 8> expectedMagic = {'P', 'A', 'R', 'T', 'C', 'K', 'P', 'T'};
+        static constexpr uint32_t currentVersion = 1;
+        static constexpr uint32_t byteOrderMark = 0x01020304; // Reads differently on a machine of the other endianness
+
+        std::array<char, 8> magic = expectedMagic;
+        uint32_t version = currentVersion;
+        uint32_t byteOrder = byteOrderMark;
+        uint64_t particleCount = 0;
+        uint64_t step = 0;
+        std::array<uint64_t, static_cast<size_t>(CheckpointBlock::Count)> offsets{}; // From the start of the file
+        uint64_t fileSize = 0;
+};
+
+/*
+ * Snapshot of all particles: a header followed by one page aligned block per field (structure of arrays).
+ * Loading maps the file and hands out views into it, nothing is parsed per particle.
+ * Particles are only consistent between steps, a checkpoint must not be taken in the middle of one.
+ */
+class Checkpoint {
+    public:
+        static constexpr size_t alignment = 4096;
+
+        // Writes into a temporary file first, an existing checkpoint is only replaced by a complete one
+        static void write(const std::filesystem::path& path, std::span<const Particle> particles, uint64_t step) {
+            const size_t count = particles.size();
+            std::vector<Position> positions(count);
+            std::vector<Vector3d> velocities(count);
+            std::vector<Vector3d> spins(count);
+            std::vector<double> masses(count);
+            std::vector<uint8_t> flags(count);
+            for (size_t i = 0; i < count; i++) {
+                positions[i] = particles[i].position();
+                velocities[i] = particles[i].velocity();
+                spins[i] = particles[i].spin();
+                masses[i] = particles[i].mass();
+                flags[i] = particles[i].isEnabled() ? ParticleEnabled : 0;
+            }
+
+            const CheckpointHeader header = layout(count, step);
+            const std::array<std::span<const std::byte>, blockCount> blocks = {
+                std::as_bytes(std::span(positions)), std::as_bytes(std::span(velocities)), std::as_bytes(std::span(spins)), std::as_bytes(std::span(masses)),
+                std::as_bytes(std::span(flags)),
+            };
+
+            std::filesystem::path temporary = path;
+            temporary += ".tmp";
+            writeFile(temporary, header, blocks);
+            std::filesystem::rename(temporary, path);
+        }
+
+        explicit Checkpoint(const std::filesystem::path& path) :
+                _file(path) {
+            validate(path);
+        }
+
+        size_t size() const {
+            return header().particleCount;
+        }
+
+        uint64_t step() const {
+            return header().step;
+        }
+
+        std::span<const Position> positions() const {
+            return block<Position>(CheckpointBlock::Position);
+        }
+
+        std::span<const Vector3d> velocities() const {
+            return block<Vector3d>(CheckpointBlock::Velocity);
+        }
+
+        std::span<const Vector3d> spins() const {
+            return block<Vector3d>(CheckpointBlock::Spin);
+        }
+
+        std::span<const double> masses() const {
+            return block<double>(CheckpointBlock::Mass);
+        }
+
+        std::span<const uint8_t> flags() const {
+            return block<uint8_t>(CheckpointBlock::Flags);
+        }
+
+        // Replaces the particles with the ones of the checkpoint
+        void restore(std::vector<Particle>& particles) const {
+            particles.clear();
+            particles.reserve(size());
+
+            const std::span<const Position> positions = this->positions();
+            const std::span<const Vector3d> velocities = this->velocities();
+            const std::span<const Vector3d> spins = this->spins();
+            const std::span<const double> masses = this->masses();
+            const std::span<const uint8_t> flags = this->flags();
+            for (size_t i = 0; i < size(); i++) {
+                Particle& p = particles.emplace_back(positions[i], velocities[i], spins[i], masses[i]);
+                if ((flags[i] & ParticleEnabled) == 0) {
+                    p.disable();
+                }
+            }
+        }
+
+    private:
+        static constexpr size_t blockCount = static_cast<size_t>(CheckpointBlock::Count);
+        static constexpr std::array<size_t, blockCount> elementSizes = {sizeof(Position), sizeof(Vector3d), sizeof(Vector3d), sizeof(double), sizeof(uint8_t)};
+
+        MappedFile _file;
+
+        static constexpr uint64_t alignUp(uint64_t offset) {
+            return (offset + alignment - 1) / alignment * alignment;
+        }
+
+        static CheckpointHeader layout(size_t count, uint64_t step) {
+            CheckpointHeader header;
+            header.particleCount = count;
+            header.step = step;
+
+            uint64_t offset = alignUp(sizeof(CheckpointHeader));
+            for (size_t block = 0; block < blockCount; block++) {
+                header.offsets[block] = offset;
+                offset = alignUp(offset + count * elementSizes[block]);
+            }
+            header.fileSize = offset;
+            return header;
+        }
+
+        const CheckpointHeader& header() const {
+            return *reinterpret_cast<const CheckpointHeader*>(_file.data());
+        }
+
+        template <typename T>
+        std::span<const T> block(CheckpointBlock block) const {
+            return std::span(reinterpret_cast<const T*>(_file.data() + header().offsets[static_cast<size_t>(block)]), size());
+        }
+
+        void validate(const std::filesystem::path& path) const {
+            if ((_file.size() < sizeof(CheckpointHeader)) or (header().magic != CheckpointHeader::expectedMagic)) {
+                throw std::runtime_error(std::format("{} is not a checkpoint", path.string()));
+            }
+            if ((header().version != CheckpointHeader::currentVersion) or (header().byteOrder != CheckpointHeader::byteOrderMark)) {
+                throw std::runtime_error(std::format("{} has version {} or was written on a machine of different endianness", path.string(), header().version));
+            }
+
+            const CheckpointHeader expected = layout(header().particleCount, header().step);
+            if ((header().offsets != expected.offsets) or (header().fileSize != expected.fileSize) or (_file.size() < expected.fileSize)) {
+                throw std::runtime_error(std::format("{} is truncated or corrupt", path.string()));
+            }
+        }
+
+#ifdef _WIN32
+        // No writev, the blocks are written one by one
+        static void writeFile(const std::filesystem::path& path, const CheckpointHeader& header, const std::array<std::span<const std::byte>, blockCount>& blocks) {
+            std::ofstream out(path, std::ios::binary | std::ios::trunc);
+            out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+            uint64_t written = sizeof(header);
+            for (size_t block = 0; block < blockCount; block++) {
+                const std::vector<char> padding(header.offsets[block] - written);
+                out.write(padding.data(), padding.size());
+                out.write(reinterpret_cast<const char*>(blocks[block].data()), blocks[block].size());
+                written = header.offsets[block] + blocks[block].size();
+            }
+            const std::vector<char> padding(header.fileSize - written);
+            out.write(padding.data(), padding.size());
+
+            if (!out) {
+                throw std::runtime_error(std::format("Could not write checkpoint {}", path.string()));
+            }
+        }
+#else
+        // Everything including the padding in one pwritev, repeated only for what a short write left over
+        static void writeFile(const std::filesystem::path& path, const CheckpointHeader& header, const std::array<std::span<const std::byte>, blockCount>& blocks) {
+            static const std::vector<std::byte> zeros(alignment);
+
+            std::vector<iovec> parts;
+            uint64_t end = 0;
+            auto add = [&parts, &end](const void* data, size_t size) {
+                if (size > 0) {
+                    parts.push_back(iovec(const_cast<void*>(data), size));
+                    end += size;
+                }
+            };
+
+            add(&header, sizeof(header));
+            for (size_t block = 0; block < blockCount; block++) {
+                add(zeros.data(), header.offsets[block] - end);
+                add(blocks[block].data(), blocks[block].size());
+            }
+            add(zeros.data(), header.fileSize - end);
+
+            const int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0) {
+                throw std::runtime_error(std::format("Could not create checkpoint {}", path.string()));
+            }
+
+            uint64_t offset = 0;
+            size_t first = 0;
+            while (first < parts.size()) {
+                const ssize_t written = ::pwritev(fd, parts.data() + first, static_cast<int>(std::min<size_t>(parts.size() - first, IOV_MAX)), offset);
+                if (written <= 0) {
+                    ::close(fd);
+                    throw std::runtime_error(std::format("Could not write checkpoint {}", path.string()));
+                }
+
+                offset += written;
+                for (size_t remaining = written; remaining > 0;) {
+                    const size_t consumed = std::min(remaining, parts[first].iov_len);
+                    parts[first].iov_base = static_cast<std::byte*>(parts[first].iov_base) + consumed;
+                    parts[first].iov_len -= consumed;
+                    remaining -= consumed;
+                    if (parts[first].iov_len == 0) {
+                        first++;
+                    }
+                }
+            }
+
+            ::fsync(fd);
+            ::close(fd);
+        }
+#endif
+};
\ No newline at end of file
@@ -0,0 +1,372 @@
+#pragma once
+
+#include "BarnesHut.h"
+#include "Particle.h"
+#include "ThreadPool.h"
+#include "Transport.h"
+#include "World.h"
+
+#include <algorithm>
+#include <array>
+#include <span>
+#include <vector>
+
+constexpr std::array<double Position::*, 3> axes{&Position::x, &Position::y, &Position::z};
+
+// Box [from; to[ of space owned by one rank
+struct Domain {
+        Position from;
+        Position to;
+
+        bool contains(const Position& pos) const {
+            return (from.x <= pos.x) and (pos.x < to.x) and (from.y <= pos.y) and (pos.y < to.y) and (from.z <= pos.z) and (pos.z < to.z);
+        }
+
+        // 0 inside of the box
+        double distance(const Position& pos) const {
+            const double dx = std::max({from.x - pos.x, 0.0, pos.x - to.x});
+            const double dy = std::max({from.y - pos.y, 0.0, pos.y - to.y});
+            const double dz = std::max({from.z - pos.z, 0.0, pos.z - to.z});
+            return std::sqrt(dx * dx + dy * dy + dz * dz);
+        }
+};
+
+struct WeightedSample {
+        Position position;
+        double weight;
+};
+
+// A particle moving to another rank, with the cost it had on the old one
+struct MigratingParticle {
+        Position position;
+        Vector3d velocity;
+        Vector3d spin;
+        double mass;
+        double cost;
+};
+
+// A point of mass of the locally essential tree, a particle or a whole cell
+struct RemoteMass {
+        Position position;
+        double mass;
+};
+
+/*
+ * Orthogonal recursive bisection: cuts a box across its longest axis so that both halves carry the share of the weight
+ * that belongs to their ranks, then cuts the halves for their ranks, until every rank has a box.
+ */
+class OrbDecomposition {
+    public:
+        // Deterministic, ranks that pass the same samples get the same domains
+        static std::vector<Domain> decompose(std::vector<WeightedSample> samples, const Domain& bounds, int ranks) {
+            std::vector<Domain> domains(ranks);
+            bisect(samples, bounds, 0, ranks, domains);
+            return domains;
+        }
+
+    private:
+        static void bisect(std::span<WeightedSample> samples, const Domain& box, int firstRank, int ranks, std::vector<Domain>& domains) {
+            if (ranks == 1) {
+                domains[firstRank] = box;
+                return;
+            }
+
+            const Vector3d extent = box.to - box.from;
+            const int axis = (extent.x >= extent.y) ? ((extent.x >= extent.z) ? 0 : 2) : ((extent.y >= extent.z) ? 1 : 2);
+            const auto coordinate = axes[axis];
+            std::ranges::sort(samples, {}, [coordinate](const WeightedSample& sample) {
+                return sample.position.*coordinate;
+            });
+
+            const int leftRanks = ranks / 2;
+            double total = 0.0;
+            for (const WeightedSample& sample : samples) {
+                total += sample.weight;
+            }
+
+            // Without weight the box is cut by volume
+            double cut = box.from.*coordinate + extent.*coordinate * leftRanks / ranks;
+            size_t split = 0;
+            if (total > 0.0) {
+                const double target = total * leftRanks / ranks;
+                double below = 0.0;
+                while ((split < samples.size()) and (below + samples[split].weight <= target)) {
+                    below += samples[split].weight;
+                    split++;
+                }
+                if (split == 0) {
+                    cut = samples.front().position.*coordinate;
+                } else if (split == samples.size()) {
+                    cut = std::nextafter(samples.back().position.*coordinate, box.to.*coordinate);
+                } else {
+                    cut = (samples[split - 1].position.*coordinate + samples[split].position.*coordinate) / 2.0;
+                }
+                cut = std::clamp(cut, box.from.*coordinate, box.to.*coordinate);
+            } else {
+                split = std::ranges::partition_point(samples, [coordinate, cut](const WeightedSample& sample) {
+                    return sample.position.*coordinate < cut;
+                }) - samples.begin();
+            }
+
+            Domain left = box;
+            Domain right = box;
+            left.to.*coordinate = cut;
+            right.from.*coordinate = cut;
+            bisect(samples.first(split), left, firstRank, leftRanks, domains);
+            bisect(samples.subspan(split), right, firstRank + leftRanks, ranks - leftRanks, domains);
+        }
+};
+
+/*
+ * One rank of a simulation that is split across processes, every rank owns the particles inside of its domain.
+ * A step exchanges with all other ranks:
+ *  - Every rebalance interval the domains are cut anew by ORB, weighted with the cells every particle visited in the last force walk.
+ *  - Particles that left the domain of their rank migrate to their new owner.
+ *  - Every rank sends every other one its locally essential tree: the cells of its tree that are far enough from the
+ *    receiving domain as a single point of mass, the particles of the ones that are not. They become remote leaves of the receiver's tree.
+ * Particles of different ranks only attract each other, collisions and merges happen within a rank.
+ */
+class DistributedWorld {
+    public:
+        static constexpr size_t samplesPerRank = 1024;
+
+        // Every rank must use the same extent
+        DistributedWorld(Transport& transport, double extent) :
+                _transport(transport),
+                _bounds(Position(-extent, -extent, -extent), Position(extent, extent, extent)),
+                _barnesHut(_bounds.from, _bounds.to) {
+        }
+
+        // Any rank can place any particle, it migrates to its owner during the next step
+        void placeParticle(const Particle& p) {
+            _particles.push_back(p);
+            _costs.push_back(1.0);
+        }
+
+        // Collective, all ranks call it together
+        void step() {
+            if (_domains.empty() or ((_steps % _rebalanceInterval) == 0)) {
+                rebalance();
+            }
+            migrate();
+
+            _barnesHut.resetCalculation();
+            _barnesHut.insertParticles(_particles);
+            exchangeEssentialTree();
+
+            forEachParticleColliding(_particles, _execution, [this](Particle& p, std::vector<Collision>* collisions) {
+                const size_t index = &p - _particles.data();
+                _costs[index] = static_cast<double>(_barnesHut.calculateAcceleration(p, collisions));
+            });
+            forEachParticle([](Particle& p) {
+                p.step();
+            });
+            _steps++;
+        }
+
+        // Collective, enabled particles of all ranks
+        size_t totalParticles() {
+            double local = 0.0;
+            for (const Particle& p : _particles) {
+                local += p.isEnabled() ? 1.0 : 0.0;
+            }
+            return static_cast<size_t>(sum(gather(local)));
+        }
+
+        // Collective, the cost of the most expensive rank relative to the average. 1 is perfectly balanced
+        double costImbalance() {
+            double local = 0.0;
+            for (double cost : _costs) {
+                local += cost;
+            }
+            const std::vector<double> costs = gather(local);
+            const double mean = sum(costs) / costs.size();
+            return (mean > 0.0) ? (std::ranges::max(costs) / mean) : 1.0;
+        }
+
+        std::vector<Particle>& particles() {
+            return _particles;
+        }
+
+        const std::vector<Particle>& particles() const {
+            return _particles;
+        }
+
+        // Points of mass from the other ranks in the last step
+        size_t remoteCount() const {
+            return _remote.size();
+        }
+
+        const std::vector<Domain>& domains() const {
+            return _domains;
+        }
+
+        BarnesHut& barnesHut() {
+            return _barnesHut;
+        }
+
+        void setRebalanceInterval(uint64_t steps) {
+            _rebalanceInterval = std::max<uint64_t>(1, steps);
+        }
+
+        // Threads within this rank
+        void setExecution(Execution execution) {
+            _execution = execution;
+        }
+
+        uint64_t getSteps() const {
+            return _steps;
+        }
+
+    private:
+        Transport& _transport;
+        Domain _bounds;
+        std::vector<Particle> _particles;
+        std::vector<double> _costs; // Cells visited in the last force walk, parallel to _particles
+        std::vector<Particle> _remote;
+        std::vector<Domain> _domains;
+        BarnesHut _barnesHut;
+        Execution _execution = Execution::Sequential;
+        uint64_t _rebalanceInterval = 10;
+        uint64_t _steps = 0;
+
+        // Every rank samples its particles, so all ranks cut the same domains from the same few thousand points
+        void rebalance() {
+            std::vector<WeightedSample> samples;
+            const size_t stride = std::max<size_t>(1, _particles.size() / samplesPerRank);
+            for (size_t from = 0; from < _particles.size(); from += stride) {
+                double weight = 0.0;
+                for (size_t i = from; i < std::min(_particles.size(), from + stride); i++) {
+                    weight += _particles[i].isEnabled() ? _costs[i] : 0.0;
+                }
+
+                if (_bounds.contains(_particles[from].position())) {
+                    samples.emplace_back(_particles[from].position(), weight);
+                }
+            }
+
+            Buffer buffer;
+            message::append(buffer, std::span<const WeightedSample>(samples));
+            std::vector<WeightedSample> all;
+            for (const Buffer& received : _transport.allGather(buffer)) {
+                const std::vector<WeightedSample> fromRank = message::read<WeightedSample>(received);
+                all.insert(all.end(), fromRank.begin(), fromRank.end());
+            }
+            _domains = OrbDecomposition::decompose(std::move(all), _bounds, _transport.size());
+        }
+
+        // Also drops merged particles. Particles outside of the bounds stay where they are, like they stay out of the tree
+        void migrate() {
+            std::vector<Buffer> outgoing(_transport.size());
+            size_t kept = 0;
+            for (size_t i = 0; i < _particles.size(); i++) {
+                const Particle& p = _particles[i];
+                if (!p.isEnabled()) {
+                    continue;
+                }
+
+                const int owner = ownerOf(p.position());
+                if (owner == _transport.rank()) {
+                    _particles[kept] = p;
+                    _costs[kept] = _costs[i];
+                    kept++;
+                } else {
+                    message::append(outgoing[owner], MigratingParticle(p.position(), p.velocity(), p.spin(), p.mass(), _costs[i]));
+                }
+            }
+            _particles.resize(kept);
+            _costs.resize(kept);
+
+            for (const Buffer& received : _transport.allToAll(std::move(outgoing))) {
+                for (const MigratingParticle& migrating : message::read<MigratingParticle>(received)) {
+                    _particles.emplace_back(migrating.position, migrating.velocity, migrating.spin, migrating.mass);
+                    _costs.push_back(migrating.cost);
+                }
+            }
+        }
+
+        void exchangeEssentialTree() {
+            const double threshold = _barnesHut.getInfluenceThreshold();
+            std::vector<Buffer> outgoing(_transport.size());
+            for (int rank = 0; rank < _transport.size(); rank++) {
+                if (rank == _transport.rank()) {
+                    continue;
+                }
+
+                const Domain& domain = _domains[rank];
+                std::vector<RemoteMass> essential;
+                _barnesHut.traverse([&essential, &domain, threshold](const Node& node) {
+                    if (node.isLeaf()) {
+                        essential.emplace_back(node.particle->position(), node.particle->mass());
+                        return false;
+                    }
+
+                    // Opened by no particle of the domain, the closest one included
+                    const Position centerOfMass = node.centerOfMass();
+                    if ((node.to.x - node.from.x) < threshold * domain.distance(centerOfMass)) {
+                        essential.emplace_back(centerOfMass, node.mass);
+                        return false;
+                    }
+                    return true;
+                });
+                message::append(outgoing[rank], std::span<const RemoteMass>(essential));
+            }
+
+            const std::vector<Buffer> incoming = _transport.allToAll(std::move(outgoing));
+            size_t remoteCount = 0;
+            for (const Buffer& received : incoming) {
+                remoteCount += received.size() / sizeof(RemoteMass);
+            }
+
+            // The tree points into _remote, it must not grow while being filled
+            _remote.clear();
+            _remote.reserve(remoteCount);
+            for (const Buffer& received : incoming) {
+                for (const RemoteMass& mass : message::read<RemoteMass>(received)) {
+                    _remote.emplace_back(mass.position, Vector3d(0.0, 0.0, 0.0), Vector3d(0.0, 0.0, 0.0), mass.mass);
+                }
+            }
+            _barnesHut.insertParticles(_remote, true);
+        }
+
+        int ownerOf(const Position& pos) const {
+            if (!_bounds.contains(pos)) {
+                return _transport.rank();
+            }
+            for (size_t rank = 0; rank < _domains.size(); rank++) {
+                if (_domains[rank].contains(pos)) {
+                    return static_cast<int>(rank);
+                }
+            }
+            return _transport.rank();
+        }
+
+        std::vector<double> gather(double value) {
+            Buffer buffer;
+            message::append(buffer, value);
+            std::vector<double> values;
+            for (const Buffer& received : _transport.allGather(buffer)) {
+                values.push_back(message::read<double>(received).front());
+            }
+            return values;
+        }
+
+        static double sum(const std::vector<double>& values) {
+            double total = 0.0;
+            for (double value : values) {
+                total += value;
+            }
+            return total;
+        }
+
+        template <typename Function>
+        void forEachParticle(Function&& function) {
+            if (_execution == Execution::Parallel) {
+                ThreadPool::global().parallelFor(0, _particles.size(), [this, &function](size_t i) {
+                    function(_particles[i]);
+                });
+            } else {
+                std::for_each(_particles.begin(), _particles.end(), function);
+            }
+        }
+};
\ No newline at end of file
@@ -0,0 +1,126 @@
+#pragma once
+
+#include "Checkpoint.h"
+#include "Particle.h"
+
+#include <filesystem>
+#include <fstream>
+#include <span>
+#include <system_error>
+
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+enum class CheckpointMode {
+    Blocking, // Written before the call returns
+    Forked    // Written by a child process while the simulation goes on
+};
+
+enum class CheckpointState {
+    Idle,
+    Writing,
+    Completed,
+    Failed
+};
+
+/*
+ * Writes a checkpoint from a forked child process. Copy-on-write keeps the particles of the child exactly as they
+ * were at fork time while the parent goes on simulating, the parent only pays for copying its page tables.
+ * The child creates "<checkpoint>.done" after the checkpoint is in place, the parent polls for it and reaps the child.
+ * Without fork (Windows) or if fork fails, the checkpoint is written blocking.
+ */
+class ForkedCheckpoint {
+    public:
+        ForkedCheckpoint() = default;
+        ForkedCheckpoint(const ForkedCheckpoint&) = delete;
+        ForkedCheckpoint& operator=(const ForkedCheckpoint&) = delete;
+
+        ~ForkedCheckpoint() {
+            wait();
+        }
+
+        static std::filesystem::path completionFile(const std::filesystem::path& path) {
+            std::filesystem::path done = path;
+            done += ".done";
+            return done;
+        }
+
+        // Must be called between steps. False if the previous checkpoint is still being written
+        bool start(const std::filesystem::path& path, std::span<const Particle> particles, uint64_t step) {
+            if (state() == CheckpointState::Writing) {
+                return false;
+            }
+
+            std::error_code ignored;
+            std::filesystem::remove(completionFile(path), ignored);
+            _path = path;
+
+#ifndef _WIN32
+            const pid_t pid = ::fork();
+            if (pid == 0) {
+                // Only this thread exists in the child. _exit skips the destructors and atexit handlers of the parent
+                int exitCode = 0;
+                try {
+                    Checkpoint::write(path, particles, step);
+                    std::ofstream(completionFile(path)) << step << '\n';
+                } catch (...) {
+                    exitCode = 1;
+                }
+                ::_exit(exitCode);
+            }
+
+            if (pid > 0) {
+                _child = pid;
+                _state = CheckpointState::Writing;
+                return true;
+            }
+#endif
+
+            try {
+                Checkpoint::write(path, particles, step);
+                _state = CheckpointState::Completed;
+            } catch (...) {
+                _state = CheckpointState::Failed;
+            }
+            return true;
+        }
+
+        // Polls the child without blocking
+        CheckpointState state() {
+#ifndef _WIN32
+            if (_state == CheckpointState::Writing) {
+                int status = 0;
+                if (::waitpid(_child, &status, WNOHANG) == _child) {
+                    finish(status);
+                }
+            }
+#endif
+            return _state;
+        }
+
+        void wait() {
+#ifndef _WIN32
+            if (_state == CheckpointState::Writing) {
+                int status = 0;
+                ::waitpid(_child, &status, 0);
+                finish(status);
+            }
+#endif
+        }
+
+    private:
+        std::filesystem::path _path;
+        CheckpointState _state = CheckpointState::Idle;
+#ifndef _WIN32
+        pid_t _child = -1;
+
+        void finish(int status) {
+            const bool exited = WIFEXITED(status) and (WEXITSTATUS(status) == 0);
+            _state = (exited and std::filesystem::exists(completionFile(_path))) ? CheckpointState::Completed : CheckpointState::Failed;
+            _child = -1;
+        }
+#endif
+};
\ No newline at end of file
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <format>
+#include <string>
+
+struct QualitySettings {
+        double theta = 0.5;        // Barnes-Hut opening angle, smaller is more accurate
+        double lodPixelSize = 1.0; // Octree cells smaller than this are rendered as one
+        int substeps = 1;          // Physics steps per displayed frame
+};
+
+/*
+ * Trades accuracy for speed to hold a target frame time.
+ * Over budget it relieves whichever phase is more expensive, with time left it first restores accuracy and only then
+ * spends the rest on additional physics steps per frame.
+ */
+class FrameGovernor {
+        using Milliseconds = std::chrono::duration<double, std::milli>;
+
+    public:
+        static constexpr double minTheta = 0.3;
+        static constexpr double maxTheta = 1.2;
+        static constexpr double thetaStep = 0.05;
+        static constexpr double maxLodPixelSize = 8.0;
+        static constexpr int maxSubsteps = 8;
+
+        explicit FrameGovernor(Milliseconds targetFrameTime) :
+                _targetFrameTime(targetFrameTime) {
+        }
+
+        void update(Milliseconds physicsTime, Milliseconds renderTime) {
+            _physicsTime = smooth(_physicsTime, physicsTime);
+            _renderTime = smooth(_renderTime, renderTime);
+
+            if (!_enabled or (++_framesSinceChange < _cooldown)) {
+                return;
+            }
+
+            const Milliseconds frameTime = _physicsTime + _renderTime;
+            if (frameTime > _targetFrameTime * 1.05) {
+                degrade();
+            } else if (frameTime < _targetFrameTime * 0.75) {
+                improve();
+            }
+        }
+
+        // Knobs that have no effect on the current frames are left alone, or changing them would look like a saving
+        void setKnobs(bool theta, bool levelOfDetail) {
+            _thetaKnob = theta;
+            _lodKnob = levelOfDetail;
+        }
+
+        const QualitySettings& settings() const {
+            return _settings;
+        }
+
+        void setTargetFrameTime(Milliseconds targetFrameTime) {
+            _targetFrameTime = targetFrameTime;
+        }
+
+        void setEnabled(bool enabled) {
+            _enabled = enabled;
+            if (!_enabled) {
+                _settings = QualitySettings();
+            }
+        }
+
+        bool isEnabled() const {
+            return _enabled;
+        }
+
+        std::string toString() const {
+            return std::format("theta {:.2f} | LOD {:.1f}px | {} substeps | physics {:.1f}ms render {:.1f}ms", _settings.theta, _settings.lodPixelSize, _settings.substeps, _physicsTime.count(),
+                _renderTime.count());
+        }
+
+    private:
+        static constexpr int _cooldown = 5; // Frames to see the effect of the last change
+
+        Milliseconds _targetFrameTime;
+        Milliseconds _physicsTime{0};
+        Milliseconds _renderTime{0};
+        QualitySettings _settings;
+        int _framesSinceChange = 0;
+        bool _enabled = false;
+        bool _thetaKnob = true;
+        bool _lodKnob = true;
+
+        static Milliseconds smooth(Milliseconds average, Milliseconds sample) {
+            return (average.count() <= 0) ? sample : (average * 0.8 + sample * 0.2);
+        }
+
+        void degrade() {
+            if (_physicsTime >= _renderTime) {
+                if (_settings.substeps > 1) {
+                    _settings.substeps--;
+                } else if (_thetaKnob and (_settings.theta < maxTheta)) {
+                    _settings.theta = std::min(maxTheta, _settings.theta + thetaStep);
+                } else {
+                    return;
+                }
+            } else if (_lodKnob and (_settings.lodPixelSize < maxLodPixelSize)) {
+                _settings.lodPixelSize = std::min(maxLodPixelSize, _settings.lodPixelSize * 2);
+            } else {
+                return;
+            }
+
+            _framesSinceChange = 0;
+        }
+
+        void improve() {
+            const Milliseconds physicsPerStep = _physicsTime / _settings.substeps;
+
+            if (_lodKnob and (_settings.lodPixelSize > 1.0)) {
+                _settings.lodPixelSize = std::max(1.0, _settings.lodPixelSize / 2);
+            } else if (_thetaKnob and (_settings.theta > minTheta)) {
+                _settings.theta = std::max(minTheta, _settings.theta - thetaStep);
+            } else if ((_settings.substeps < maxSubsteps) and (_physicsTime + physicsPerStep + _renderTime < _targetFrameTime * 0.9)) {
+                _settings.substeps++;
+            } else {
+                return;
+            }
+
+            _framesSinceChange = 0;
+        }
+};
\ No newline at end of file
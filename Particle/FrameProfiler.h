@@ -0,0 +1,236 @@
+#pragma once
+
+#include "PerfCounters.h"
+#include "Tracer.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+enum class Phase {
+    Events,
+    EraseDisabled,
+    TreeBuild,
+    ForceWalk,
+    Integration,
+    Rasterization,
+    TextureUpload,
+    Display,
+    Count
+};
+
+constexpr std::array<std::string_view, static_cast<size_t>(Phase::Count)> phaseNames = {
+    "events", "erase_if", "tree build", "force walk", "integration", "raster", "texture upload", "display",
+};
+
+struct PhaseStats {
+        double min = 0.0; // ms
+        double mean = 0.0;
+        double p99 = 0.0;
+};
+
+/*
+ * Collects the time spent per phase of every frame. Phases that run more than once per frame (substeps) add up.
+ * Keeps the last frames for rolling statistics and optionally writes every frame as a CSV row.
+ * With hardware counters attached, the events that happened during a phase are attributed to it the same way.
+ */
+class FrameProfiler {
+        using Clock = std::chrono::steady_clock;
+        static constexpr size_t phaseCount = static_cast<size_t>(Phase::Count);
+        static constexpr size_t window = 240; // Frames
+
+    public:
+        // Does nothing without a profiler, so call sites don't need to check. Also shows up in traces.
+        class ScopedTimer {
+            public:
+                ScopedTimer(FrameProfiler* profiler, Phase phase) :
+                        _profiler(profiler),
+                        _phase(phase),
+                        _trace(phaseNames[static_cast<size_t>(phase)].data()) {
+                    if (_profiler != nullptr) {
+                        if (_profiler->_counters != nullptr) {
+                            _startCounters = _profiler->_counters->read();
+                        }
+                        _start = Clock::now();
+                    }
+                }
+
+                ScopedTimer(const ScopedTimer&) = delete;
+                ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+                ~ScopedTimer() {
+                    if (_profiler != nullptr) {
+                        _profiler->add(_phase, Clock::now() - _start);
+                        if (_profiler->_counters != nullptr) {
+                            _profiler->addCounters(_phase, _startCounters, _profiler->_counters->read());
+                        }
+                    }
+                }
+
+            private:
+                FrameProfiler* _profiler;
+                Phase _phase;
+                Clock::time_point _start;
+                CounterValues _startCounters{};
+                Tracer::Scope _trace;
+        };
+
+        void add(Phase phase, Clock::duration duration) {
+            _current[static_cast<size_t>(phase)] += std::chrono::duration<double, std::milli>(duration).count();
+        }
+
+        void addCounters(Phase phase, const CounterValues& from, const CounterValues& to) {
+            CounterValues& current = _currentCounters[static_cast<size_t>(phase)];
+            for (size_t counter = 0; counter < current.size(); counter++) {
+                current[counter] += to[counter] - from[counter];
+            }
+        }
+
+        // Time spent in the phase during the frame that is currently measured
+        double current(Phase phase) const {
+            return _current[static_cast<size_t>(phase)];
+        }
+
+        void finishFrame() {
+            const size_t slot = _frames % window;
+            for (size_t phase = 0; phase < phaseCount; phase++) {
+                _history[phase][slot] = _current[phase];
+            }
+
+            if (_csv.is_open()) {
+                _csv << _frames;
+                for (double milliseconds : _current) {
+                    _csv << ',' << milliseconds;
+                }
+                if (_csvWithCounters) {
+                    for (const CounterValues& values : _currentCounters) {
+                        for (uint64_t value : values) {
+                            _csv << ',' << value;
+                        }
+                    }
+                }
+                _csv << '\n';
+            }
+
+            if (_counters != nullptr) {
+                _counterHistory[_counterFrames % window] = _currentCounters;
+                _counterFrames++;
+            }
+
+            _frames++;
+            _current.fill(0.0);
+            _currentCounters.fill({});
+        }
+
+        // Nullptr detaches, the counters must stay open while attached
+        void setPerfCounters(PerfCounters* counters) {
+            _counters = counters;
+            _counterHistory.assign((_counters != nullptr) ? window : 0, {});
+            _counterFrames = 0;
+        }
+
+        // Events per frame of the phase, averaged over the last frames
+        CounterValues counterMean(Phase phase) const {
+            CounterValues mean{};
+            const size_t count = std::min(_counterFrames, window);
+            if (count == 0) {
+                return mean;
+            }
+
+            for (size_t frame = 0; frame < count; frame++) {
+                const CounterValues& values = _counterHistory[frame][static_cast<size_t>(phase)];
+                for (size_t counter = 0; counter < mean.size(); counter++) {
+                    mean[counter] += values[counter];
+                }
+            }
+            for (uint64_t& value : mean) {
+                value /= count;
+            }
+            return mean;
+        }
+
+        PhaseStats stats(Phase phase) const {
+            const size_t count = std::min(_frames, window);
+            if (count == 0) {
+                return {};
+            }
+
+            std::array<double, window> samples;
+            const std::array<double, window>& history = _history[static_cast<size_t>(phase)];
+            std::copy_n(history.begin(), count, samples.begin());
+
+            PhaseStats out;
+            out.min = *std::min_element(samples.begin(), samples.begin() + count);
+            for (size_t i = 0; i < count; i++) {
+                out.mean += samples[i];
+            }
+            out.mean /= count;
+
+            const size_t p99Index = (count * 99) / 100;
+            std::nth_element(samples.begin(), samples.begin() + p99Index, samples.begin() + count);
+            out.p99 = samples[p99Index];
+            return out;
+        }
+
+        std::string toString() const {
+            std::string out = "phase: min / mean / p99 ms";
+            for (size_t phase = 0; phase < phaseCount; phase++) {
+                const PhaseStats phaseStats = stats(static_cast<Phase>(phase));
+                out += std::format("\n{}: {:.2f} / {:.2f} / {:.2f}", phaseNames[phase], phaseStats.min, phaseStats.mean, phaseStats.p99);
+            }
+
+            if (_counters != nullptr) {
+                out += "\nphase: IPC | L1d / LLC / branch misses per frame";
+                for (size_t phase = 0; phase < phaseCount; phase++) {
+                    const CounterValues mean = counterMean(static_cast<Phase>(phase));
+                    const uint64_t cycles = mean[static_cast<size_t>(Counter::Cycles)];
+                    if (cycles == 0) {
+                        continue;
+                    }
+                    out += std::format("\n{}: {:.2f} | {} / {} / {}", phaseNames[phase], static_cast<double>(mean[static_cast<size_t>(Counter::Instructions)]) / cycles,
+                        mean[static_cast<size_t>(Counter::L1DataMisses)], mean[static_cast<size_t>(Counter::LastLevelMisses)], mean[static_cast<size_t>(Counter::BranchMisses)]);
+                }
+            }
+            return out;
+        }
+
+        void openCsv(const std::filesystem::path& path) {
+            _csv = std::ofstream(path);
+            _csv << "frame";
+            for (std::string_view name : phaseNames) {
+                _csv << ',' << name;
+            }
+            // Counter columns only if counters are attached before the file is opened
+            _csvWithCounters = _counters != nullptr;
+            if (_csvWithCounters) {
+                for (std::string_view phase : phaseNames) {
+                    for (std::string_view counter : counterNames) {
+                        _csv << ',' << phase << ' ' << counter;
+                    }
+                }
+            }
+            _csv << '\n';
+        }
+
+        void closeCsv() {
+            _csv.close();
+        }
+
+    private:
+        std::array<double, phaseCount> _current{};
+        std::array<std::array<double, window>, phaseCount> _history{};
+        size_t _frames = 0;
+        std::ofstream _csv;
+
+        PerfCounters* _counters = nullptr;
+        std::array<CounterValues, phaseCount> _currentCounters{};
+        std::vector<std::array<CounterValues, phaseCount>> _counterHistory; // Ring of the last frames
+        size_t _counterFrames = 0;
+        bool _csvWithCounters = false;
+};
\ No newline at end of file
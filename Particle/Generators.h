@@ -0,0 +1,240 @@
+#pragma once
+
+#include "Particle.h"
+#include "ThreadPool.h"
+#include "Vector.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <numbers>
+#include <span>
+#include <vector>
+
+/*
+ * Philox4x32-10 counter based random numbers (Salmon et al., "Parallel random numbers: as easy as 1, 2, 3").
+ * The output only depends on counter and key, so any value can be drawn in any order on any thread.
+ */
+class Philox4x32 {
+    public:
+        using Counter = std::array<uint32_t, 4>;
+        using Key = std::array<uint32_t, 2>;
+
+        static constexpr Counter generate(Counter counter, Key key) {
+            for (int round = 0; round < 10; round++) {
+                const uint64_t product0 = uint64_t(0xD2511F53) * counter[0];
+                const uint64_t product1 = uint64_t(0xCD9E8D57) * counter[2];
+                counter = {
+                    static_cast<uint32_t>(product1 >> 32) ^ counter[1] ^ key[0],
+                    static_cast<uint32_t>(product1),
+                    static_cast<uint32_t>(product0 >> 32) ^ counter[3] ^ key[1],
+                    static_cast<uint32_t>(product0),
+                };
+                key[0] += 0x9E3779B9;
+                key[1] += 0xBB67AE85;
+            }
+            return counter;
+        }
+
+        // Open interval ]0; 1[, safe for logarithms and inverse CDFs
+        static constexpr double toUnit(uint32_t value) {
+            return (value + 0.5) / 4294967296.0;
+        }
+};
+
+enum class Model {
+    UniformBall,
+    UniformDisk,     // Uniform in a flat cylinder
+    Plummer,         // Sphere with a core, density ~ (1 + r²/a²)^(-5/2)
+    Hernquist,       // Cuspy sphere, density ~ 1 / (r/a * (1 + r/a)³)
+    ExponentialDisk, // Surface density ~ exp(-R/h), sech² vertical profile
+    SoneiraPeebles   // Hierarchically clustered spheres within spheres
+};
+
+struct GeneratorSettings {
+        Model model = Model::UniformBall;
+        uint64_t seed = 0;
+        double radius = 500.0;   // Outer radius of uniform and clustered models, scale radius/length of the others
+        double thickness = 0.0;  // Disks: half thickness or vertical scale height
+        double particleMass = 1.0;
+
+        int levels = 8;       // Soneira-Peebles: levels of the hierarchy
+        int branching = 4;    // Soneira-Peebles: spheres inside every sphere
+        double shrink = 2.0;  // Soneira-Peebles: radius ratio from one level to the next
+};
+
+// Structure of arrays, converted into particles by the caller
+struct InitialConditions {
+        std::vector<double> x;
+        std::vector<double> y;
+        std::vector<double> z;
+        std::vector<double> mass;
+
+        size_t size() const {
+            return x.size();
+        }
+
+        Position position(size_t i) const {
+            return Position(x[i], y[i], z[i]);
+        }
+};
+
+/*
+ * Draws initial positions from a model by inverse transform sampling, without any rejection loops.
+ * Particle i only depends on (seed, i): results are identical for any thread count and any batch size.
+ */
+class Generator {
+    public:
+        // Profiles with infinite extent are cut off at this fraction of their mass
+        static constexpr double maxEnclosedMass = 0.99;
+
+        explicit Generator(const GeneratorSettings& settings) :
+                _settings(settings) {
+        }
+
+        Position position(uint64_t index) const {
+            const std::array<double, 4> u = uniforms(index, 0);
+            const double R = _settings.radius;
+
+            switch (_settings.model) {
+                case Model::UniformBall:
+                    return onSphere(R * std::cbrt(u[0]), u[1], u[2]);
+                case Model::UniformDisk:
+                    return inDisk(R * std::sqrt(u[0]), u[1], _settings.thickness * (2 * u[2] - 1));
+                case Model::Plummer: {
+                    const double m = u[0] * maxEnclosedMass;
+                    return onSphere(R / std::sqrt(std::pow(m, -2.0 / 3.0) - 1), u[1], u[2]);
+                }
+                case Model::Hernquist: {
+                    const double root = std::sqrt(u[0] * maxEnclosedMass);
+                    return onSphere(R * root / (1 - root), u[1], u[2]);
+                }
+                case Model::ExponentialDisk:
+                    return inDisk(R * inverseExponentialDisk(u[0] * maxEnclosedMass), u[1], _settings.thickness * std::atanh(2 * u[2] - 1));
+                case Model::SoneiraPeebles:
+                    return soneiraPeebles(index);
+            }
+            return Position(0.0, 0.0, 0.0);
+        }
+
+        // Particles [first; first + count[, filled in parallel
+        InitialConditions generate(size_t count, uint64_t first = 0) const {
+            InitialConditions out;
+            out.x.resize(count);
+            out.y.resize(count);
+            out.z.resize(count);
+            out.mass.assign(count, _settings.particleMass);
+
+            ThreadPool::global().parallelFor(0, count, [this, &out, first](size_t i) {
+                const Position p = position(first + i);
+                out.x[i] = p.x;
+                out.y[i] = p.y;
+                out.z[i] = p.z;
+            }, 1024);
+            return out;
+        }
+
+        const GeneratorSettings& settings() const {
+            return _settings;
+        }
+
+    private:
+        GeneratorSettings _settings;
+
+        // Streams keep the draws of particles and of Soneira-Peebles sphere centers apart
+        std::array<double, 4> uniforms(uint64_t index, uint32_t stream) const {
+            const Philox4x32::Counter counter = {static_cast<uint32_t>(index), static_cast<uint32_t>(index >> 32), stream, 0};
+            const Philox4x32::Key key = {static_cast<uint32_t>(_settings.seed), static_cast<uint32_t>(_settings.seed >> 32)};
+            const Philox4x32::Counter bits = Philox4x32::generate(counter, key);
+            return {Philox4x32::toUnit(bits[0]), Philox4x32::toUnit(bits[1]), Philox4x32::toUnit(bits[2]), Philox4x32::toUnit(bits[3])};
+        }
+
+        static Position onSphere(double radius, double uCosTheta, double uPhi) {
+            const double cosTheta = 2 * uCosTheta - 1;
+            const double sinTheta = std::sqrt(1 - cosTheta * cosTheta);
+            const double phi = 2 * std::numbers::pi * uPhi;
+            return Position(radius * sinTheta * std::cos(phi), radius * sinTheta * std::sin(phi), radius * cosTheta);
+        }
+
+        static Position inDisk(double radius, double uPhi, double z) {
+            const double phi = 2 * std::numbers::pi * uPhi;
+            return Position(radius * std::cos(phi), radius * std::sin(phi), z);
+        }
+
+        // Solves 1 - (1 + x) * exp(-x) = m for the radius in scale lengths with Newton's method
+        static double inverseExponentialDisk(double m) {
+            double x = (m < 0.5) ? std::sqrt(2 * m) : -std::log(1 - m) + 1;
+            for (int iteration = 0; iteration < 30; iteration++) {
+                const double f = 1 - (1 + x) * std::exp(-x) - m;
+                const double derivative = x * std::exp(-x);
+                const double next = std::max(x - f / derivative, x / 2);
+                if (std::abs(next - x) < 1e-12 * x) {
+                    return next;
+                }
+                x = next;
+            }
+            return x;
+        }
+
+        // Particle i lives in leaf i % leaves of a tree of spheres, every sphere sits uniformly inside its parent
+        Position soneiraPeebles(uint64_t index) const {
+            const uint64_t branching = std::max(2, _settings.branching);
+            uint64_t leaves = 1;
+            for (int level = 0; level < _settings.levels; level++) {
+                leaves *= branching;
+            }
+
+            const uint64_t leaf = index % leaves;
+            Position center(0.0, 0.0, 0.0);
+            double radius = _settings.radius;
+            uint64_t levelSize = leaves;
+            uint64_t nodeOffset = 0; // Nodes of all levels are numbered consecutively
+            for (int level = 0; level < _settings.levels; level++) {
+                levelSize /= branching;
+                nodeOffset = nodeOffset * branching + 1;
+                const uint64_t node = nodeOffset + leaf / levelSize;
+
+                const double childRadius = radius / _settings.shrink;
+                const std::array<double, 4> u = uniforms(node, 1);
+                center += onSphere((radius - childRadius) * std::cbrt(u[0]), u[1], u[2]);
+                radius = childRadius;
+            }
+
+            const std::array<double, 4> u = uniforms(index, 0);
+            return center + onSphere(radius * std::cbrt(u[0]), u[1], u[2]);
+        }
+};
+
+/*
+ * Continues a generator batch after batch, for scenarios that keep injecting matter.
+ * The batch buffer is reused, so a stream allocates only while its batches grow.
+ */
+class ParticleStream {
+    public:
+        explicit ParticleStream(const GeneratorSettings& settings, const Vector3d& velocity = Vector3d(0.0, 0.0, 0.0)) :
+                _generator(settings),
+                _velocity(velocity) {
+        }
+
+        // Valid until the next call, meant to be handed to placeParticles right away
+        std::span<const Particle> next(size_t count) {
+            const InitialConditions initial = _generator.generate(count, _emitted);
+            _batch.clear();
+            for (size_t i = 0; i < initial.size(); i++) {
+                _batch.emplace_back(initial.position(i), _velocity, Vector3d(0.0, 0.0, 0.0), initial.mass[i]);
+            }
+            _emitted += count;
+            return _batch;
+        }
+
+        uint64_t emitted() const {
+            return _emitted;
+        }
+
+    private:
+        Generator _generator;
+        Vector3d _velocity;
+        uint64_t _emitted = 0;
+        std::vector<Particle> _batch;
+};
\ No newline at end of file
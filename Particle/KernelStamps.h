@@ -0,0 +1,101 @@
+#pragma once
+
+#include "Vector.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+/*
+ * Precomputed, normalized gaussian kernels to splat particles into a density buffer.
+ * One stamp per (sigma class, sub-pixel phase x, sub-pixel phase y), so depositing a particle is nothing but
+ * multiply-adding contiguous rows. Particles larger than the biggest stamp fall back to evaluating the kernel directly.
+ */
+class KernelStamps {
+    public:
+        static constexpr int phases = 4;              // Sub-pixel positions per axis
+        static constexpr double minSigma = 0.45;      // Smallest particles still land mostly on one pixel
+        static constexpr double sigmaStep = 0.25;
+        static constexpr double maxStampSigma = 8.0;
+        static constexpr double supportInSigma = 2.0; // Kernel is cut off at 2 sigma, about the disc of the particle
+
+        struct Stamp {
+                int from_x; // Relative to the pixel that contains the center
+                int from_y;
+                int width;
+                int height;
+                size_t offset; // Into the weights
+        };
+
+        KernelStamps() {
+            const int sigmaClasses = static_cast<int>((maxStampSigma - minSigma) / sigmaStep) + 1;
+            for (int sigmaClass = 0; sigmaClass < sigmaClasses; sigmaClass++) {
+                const double sigma = minSigma + sigmaClass * sigmaStep;
+                for (int phase_y = 0; phase_y < phases; phase_y++) {
+                    for (int phase_x = 0; phase_x < phases; phase_x++) {
+                        const Vector2d center((phase_x + 0.5) / phases, (phase_y + 0.5) / phases);
+                        _stamps.push_back(createStamp(sigma, center));
+                    }
+                }
+            }
+        }
+
+        static double sigmaForRadius(double projectedRadius) {
+            return std::max(minSigma, projectedRadius / 2.0);
+        }
+
+        // Pixels around the center that can receive something
+        static int extent(double projectedRadius) {
+            return static_cast<int>(std::ceil(supportInSigma * sigmaForRadius(projectedRadius))) + 1;
+        }
+
+        bool hasStamp(double projectedRadius) const {
+            return sigmaForRadius(projectedRadius) <= maxStampSigma;
+        }
+
+        const Stamp& get(double projectedRadius, const Vector2d& center) const {
+            const int sigmaClass = static_cast<int>(std::lround((sigmaForRadius(projectedRadius) - minSigma) / sigmaStep));
+            const int phase_x = std::clamp(static_cast<int>((center.x - std::floor(center.x)) * phases), 0, phases - 1);
+            const int phase_y = std::clamp(static_cast<int>((center.y - std::floor(center.y)) * phases), 0, phases - 1);
+            return _stamps[(sigmaClass * phases + phase_y) * phases + phase_x];
+        }
+
+        const float* weights(const Stamp& stamp) const {
+            return _weights.data() + stamp.offset;
+        }
+
+        // Kernel weight of the pixel at offset from the one containing the center, not normalized
+        static double evaluate(double sigma, const Vector2d& centerInPixel, int x, int y) {
+            const double dx = (x + 0.5) - centerInPixel.x;
+            const double dy = (y + 0.5) - centerInPixel.y;
+            const double distanceSquared = dx * dx + dy * dy;
+            const double support = supportInSigma * sigma;
+            if (distanceSquared > support * support) {
+                return 0.0;
+            }
+            return std::exp(-distanceSquared / (2 * sigma * sigma));
+        }
+
+    private:
+        std::vector<Stamp> _stamps;
+        std::vector<float> _weights;
+
+        Stamp createStamp(double sigma, const Vector2d& centerInPixel) {
+            const int reach = static_cast<int>(std::ceil(supportInSigma * sigma));
+            Stamp stamp(-reach, -reach, 2 * reach + 1, 2 * reach + 1, _weights.size());
+
+            double sum = 0.0;
+            for (int y = stamp.from_y; y < stamp.from_y + stamp.height; y++) {
+                for (int x = stamp.from_x; x < stamp.from_x + stamp.width; x++) {
+                    const double weight = evaluate(sigma, centerInPixel, x, y);
+                    _weights.push_back(static_cast<float>(weight));
+                    sum += weight;
+                }
+            }
+
+            for (size_t i = stamp.offset; i < _weights.size(); i++) {
+                _weights[i] = static_cast<float>(_weights[i] / sum);
+            }
+            return stamp;
+        }
+};
\ No newline at end of file
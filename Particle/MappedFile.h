@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstddef>
+#include <filesystem>
+#include <format>
+#include <span>
+#include <stdexcept>
+
+#ifdef _WIN32
+#include <fstream>
+#include <vector>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/*
+ * Read only view of a whole file. Mapped on POSIX systems, so only the pages that are touched are read.
+ * Windows falls back to reading the file into memory.
+ */
+class MappedFile {
+    public:
+        // Throws std::runtime_error if the file can't be opened or is empty
+        explicit MappedFile(const std::filesystem::path& path) {
+#ifdef _WIN32
+            std::ifstream in(path, std::ios::binary);
+            if (!in) {
+                throw std::runtime_error(std::format("Could not open {}", path.string()));
+            }
+            _buffer.resize(std::filesystem::file_size(path));
+            in.read(reinterpret_cast<char*>(_buffer.data()), _buffer.size());
+            _data = _buffer.data();
+            _size = _buffer.size();
+#else
+            const int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                throw std::runtime_error(std::format("Could not open {}", path.string()));
+            }
+
+            struct stat status;
+            if (::fstat(fd, &status) != 0) {
+                ::close(fd);
+                throw std::runtime_error(std::format("Could not stat {}", path.string()));
+            }
+            const size_t size = static_cast<size_t>(status.st_size);
+            void* data = (size > 0) ? ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+            ::close(fd);
+
+            if (data == MAP_FAILED) {
+                throw std::runtime_error(std::format("Could not map {}", path.string()));
+            }
+            _data = static_cast<const std::byte*>(data);
+            _size = size;
+#endif
+        }
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        ~MappedFile() {
+#ifndef _WIN32
+            ::munmap(const_cast<std::byte*>(_data), _size);
+#endif
+        }
+
+        const std::byte* data() const {
+            return _data;
+        }
+
+        size_t size() const {
+            return _size;
+        }
+
+        std::span<const std::byte> bytes(size_t offset, size_t size) const {
+            return std::span(_data + offset, size);
+        }
+
+    private:
+        const std::byte* _data = nullptr;
+        size_t _size = 0;
+#ifdef _WIN32
+        std::vector<std::byte> _buffer;
+#endif
+};
\ No newline at end of file
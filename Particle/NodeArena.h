@@ -0,0 +1,156 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+
+/*
+ * Bump allocator for tree nodes. The memory comes in chunks of 2 MiB that are aligned to huge pages and,
+ * where the system allows it, backed by them. Every thread bumps through a chunk of its own, so threads building
+ * parts of a tree at the same time don't share a cursor. Nodes never move until reset, which drops all of them at once
+ * and keeps the chunks for the next build.
+ */
+template <typename T>
+class NodeArena {
+        static_assert(std::is_trivially_destructible_v<T>, "Nodes are dropped without being destroyed");
+
+    public:
+        static constexpr size_t chunkSize = size_t(2) << 20;
+        static constexpr size_t nodesPerChunk = chunkSize / sizeof(T);
+
+        NodeArena() :
+                _id(nextId()) {
+        }
+
+        NodeArena(const NodeArena&) = delete;
+        NodeArena& operator=(const NodeArena&) = delete;
+
+        ~NodeArena() {
+            for (std::byte* chunk : _chunks) {
+                freeChunk(chunk);
+            }
+        }
+
+        template <typename... Arguments>
+        T* create(Arguments&&... arguments) {
+            Cursor& cursor = localCursor();
+            if (cursor.next == cursor.end) {
+                refill(cursor);
+            }
+            return new (cursor.next++) T(std::forward<Arguments>(arguments)...);
+        }
+
+        // O(1), only while no thread creates nodes
+        void reset() {
+            std::lock_guard lock(_mutex);
+            _generation.fetch_add(1, std::memory_order_relaxed);
+            _chunksInUse = 0;
+        }
+
+        // Nodes that fit into the chunks handed out since the last reset
+        size_t capacity() const {
+            std::lock_guard lock(_mutex);
+            return _chunksInUse * nodesPerChunk;
+        }
+
+    private:
+        // Where a thread allocates next, it belongs to the given generation of one arena
+        struct Cursor {
+                uint64_t arena = 0;
+                uint64_t generation = 0;
+                T* next = nullptr;
+                T* end = nullptr;
+        };
+
+        static constexpr size_t cachedArenas = 4;
+        static inline thread_local std::array<Cursor, cachedArenas> t_cursors{};
+        static inline thread_local size_t t_evict = 0;
+
+        const uint64_t _id;
+        std::atomic<uint64_t> _generation{1};
+        mutable std::mutex _mutex;
+        std::vector<std::byte*> _chunks; // The first _chunksInUse are handed out to threads
+        size_t _chunksInUse = 0;
+
+        static uint64_t nextId() {
+            static std::atomic<uint64_t> id{1};
+            return id.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        // A cursor of an older generation points into a chunk that may be handed out again, it starts over
+        Cursor& localCursor() {
+            const uint64_t generation = _generation.load(std::memory_order_relaxed);
+            for (Cursor& cursor : t_cursors) {
+                if (cursor.arena == _id) {
+                    if (cursor.generation != generation) {
+                        cursor = Cursor(_id, generation);
+                    }
+                    return cursor;
+                }
+            }
+
+            Cursor& cursor = t_cursors[t_evict++ % cachedArenas];
+            cursor = Cursor(_id, generation);
+            return cursor;
+        }
+
+        void refill(Cursor& cursor) {
+            std::lock_guard lock(_mutex);
+            if (_chunksInUse == _chunks.size()) {
+                _chunks.push_back(allocateChunk());
+            }
+            cursor.next = reinterpret_cast<T*>(_chunks[_chunksInUse++]);
+            cursor.end = cursor.next + nodesPerChunk;
+        }
+
+        // Large pages on Windows need a privilege most users don't have, there the chunks are only aligned
+        static std::byte* allocateChunk() {
+#ifdef _WIN32
+            void* chunk = ::_aligned_malloc(chunkSize, chunkSize);
+            if (chunk == nullptr) {
+                throw std::bad_alloc();
+            }
+            return static_cast<std::byte*>(chunk);
+#else
+            // Twice the size, so an aligned chunk fits in somewhere, the rest is given back
+            void* mapping = ::mmap(nullptr, 2 * chunkSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (mapping == MAP_FAILED) {
+                throw std::bad_alloc();
+            }
+
+            std::byte* raw = static_cast<std::byte*>(mapping);
+            const uintptr_t address = reinterpret_cast<uintptr_t>(raw);
+            std::byte* chunk = raw + (((address + chunkSize - 1) & ~(chunkSize - 1)) - address);
+            if (chunk != raw) {
+                ::munmap(raw, chunk - raw);
+            }
+            if (chunk + chunkSize != raw + 2 * chunkSize) {
+                ::munmap(chunk + chunkSize, (raw + 2 * chunkSize) - (chunk + chunkSize));
+            }
+#ifdef MADV_HUGEPAGE
+            ::madvise(chunk, chunkSize, MADV_HUGEPAGE);
+#endif
+            return chunk;
+#endif
+        }
+
+        static void freeChunk(std::byte* chunk) {
+#ifdef _WIN32
+            ::_aligned_free(chunk);
+#else
+            ::munmap(chunk, chunkSize);
+#endif
+        }
+};
\ No newline at end of file
@@ -160,7 +160,12 @@ class Particle {
         }
 
         double radius() const {
-            return std::cbrt((3 * mass()) / (4 * std::numbers::pi));
+            return radiusForMass(mass());
+        }
+
+        // Of a sphere with unit density
+        static double radiusForMass(double mass) {
+            return std::cbrt((3 * mass) / (4 * std::numbers::pi));
         }
 
         double mass() const {
@@ -190,6 +195,11 @@ class Particle {
             return _enabled;
         }
 
+        // Merged into another particle, only used to restore that state
+        void disable() {
+            _enabled = false;
+        }
+
     private:
         Position _position[2];
         Vector3d _addedAcceleration[2]{};
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string_view>
+#include <utility>
+
+// Reading the counters costs a few syscalls per profiled phase, so it is off unless the build asks for it
+#ifndef PARTICLE_PERF_COUNTERS
+#define PARTICLE_PERF_COUNTERS 0
+#endif
+
+#if PARTICLE_PERF_COUNTERS && defined(__linux__)
+#include <cstring>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+enum class Counter {
+    Cycles,
+    Instructions,
+    L1DataMisses,
+    LastLevelMisses,
+    BranchMisses,
+    Count
+};
+
+constexpr std::array<std::string_view, static_cast<size_t>(Counter::Count)> counterNames = {
+    "cycles", "instructions", "L1d misses", "LLC misses", "branch misses",
+};
+
+using CounterValues = std::array<uint64_t, static_cast<size_t>(Counter::Count)>;
+
+/*
+ * Hardware performance counters of this process through perf_event_open, Linux only.
+ * Threads started after open() are counted too, so it should be opened before the first parallel algorithm spins up
+ * its workers. Without support, permission (perf_event_paranoid) or the build option every counter reads 0.
+ */
+class PerfCounters {
+    public:
+        static constexpr bool enabled = PARTICLE_PERF_COUNTERS;
+
+        PerfCounters() = default;
+        PerfCounters(const PerfCounters&) = delete;
+        PerfCounters& operator=(const PerfCounters&) = delete;
+
+        ~PerfCounters() {
+            close();
+        }
+
+        // True if at least one counter could be opened
+        bool open() {
+#if PARTICLE_PERF_COUNTERS && defined(__linux__)
+            close();
+
+            constexpr uint64_t l1dReadMiss = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+            const std::array<std::pair<uint32_t, uint64_t>, counterCount> events = {
+                {
+                 {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+                 {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+                 {PERF_TYPE_HW_CACHE, l1dReadMiss},
+                 {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+                 {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+                 }
+            };
+
+            bool any = false;
+            for (size_t counter = 0; counter < counterCount; counter++) {
+                perf_event_attr attr;
+                std::memset(&attr, 0, sizeof(attr));
+                attr.size = sizeof(attr);
+                attr.type = events[counter].first;
+                attr.config = events[counter].second;
+                attr.inherit = 1;
+                attr.exclude_kernel = 1;
+                attr.exclude_hv = 1;
+                // More counters than the PMU has are multiplexed, the times allow to scale them up
+                attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+                _fds[counter] = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+                any = any or (_fds[counter] >= 0);
+            }
+            return any;
+#else
+            return false;
+#endif
+        }
+
+        void close() {
+#if PARTICLE_PERF_COUNTERS && defined(__linux__)
+            for (int& fd : _fds) {
+                if (fd >= 0) {
+                    ::close(fd);
+                }
+                fd = -1;
+            }
+#endif
+        }
+
+        bool isAvailable(Counter counter) const {
+            return _fds[static_cast<size_t>(counter)] >= 0;
+        }
+
+        bool isOpen() const {
+            for (int fd : _fds) {
+                if (fd >= 0) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // Totals since open(), subtract two reads to get the events in between
+        CounterValues read() const {
+            CounterValues values{};
+#if PARTICLE_PERF_COUNTERS && defined(__linux__)
+            for (size_t counter = 0; counter < counterCount; counter++) {
+                uint64_t data[3]; // value, time enabled, time running
+                if ((_fds[counter] < 0) or (::read(_fds[counter], data, sizeof(data)) != sizeof(data))) {
+                    continue;
+                }
+                values[counter] = (data[2] == 0) ? 0 : static_cast<uint64_t>(data[0] * (static_cast<double>(data[1]) / data[2]));
+            }
+#endif
+            return values;
+        }
+
+    private:
+        static constexpr size_t counterCount = static_cast<size_t>(Counter::Count);
+
+        std::array<int, counterCount> _fds = {-1, -1, -1, -1, -1};
+};
\ No newline at end of file
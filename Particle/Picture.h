@@ -2,8 +2,41 @@
 
 #include "SFML/Graphics.hpp"
 
+#include "BarnesHut.h"
+#include "Camera.h"
+#include "FrameProfiler.h"
+#include "KernelStamps.h"
+#include "Particle.h"
+#include "Recorder.h"
+#include "ThreadPool.h"
 #include "Vector.h"
 
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+enum class ToneCurve {
+    Linear,
+    Log,
+    Asinh
+};
+
+struct ProjectedParticle {
+        Vector2d position;
+        double radius = 0.0;
+        bool visible = false;
+        float weight = 1.0f; // Deposited mass, the whole cell for collapsed octree cells
+};
+
+// Pixel rectangle, "to" is exclusive
+struct Tile {
+        Vector2u from;
+        Vector2u to;
+};
+
 class Picture {
     public:
         Camera camera;
@@ -12,148 +45,243 @@ class Picture {
                 _size(size),
                 _pixelsSize(_size.x * _size.y * 4),
                 _pixelBuffer(std::make_unique<sf::Uint8[]>(_pixelsSize)),
-                _particleBuffer(std::make_unique<uint16_t[]>(_size.x * _size.y)),
+                _particleBuffer(std::make_unique<float[]>(_size.x * _size.y)),
+                _renderSize(size),
                 camera(camera) {
             _tex.create(_size.x, _size.y);
+            createTiles();
+            setToneCurve(ToneCurve::Linear);
             _font.loadFromFile("ariblk.ttf");
             _textField.setFont(_font);
             _textField.setCharacterSize(20);
             _textField.setFillColor(sf::Color::White);
         }
 
-        void fill(Color color) {
-            for (size_t i = 0; i < _pixelsSize; i += 4) {
-                _pixelBuffer[i + 0] = color.x;
-                _pixelBuffer[i + 1] = color.y;
-                _pixelBuffer[i + 2] = color.z;
-                _pixelBuffer[i + 3] = 255;
-            }
-        }
-
+        // The pixel buffer doesn't need clearing, render() writes every pixel of it
         void reset() const {
-            for (size_t i = 0; i < _pixelsSize; i++) {
-                _pixelBuffer[i] = 0;
+            const size_t pixelCount = static_cast<size_t>(_renderSize.x) * _renderSize.y;
+            if (_trailDecay <= 0.0f) {
+                std::memset(_particleBuffer.get(), 0, pixelCount * sizeof(float));
+                return;
             }
 
-            for (size_t i = 0; i < _size.x * _size.y; i++) {
-                _particleBuffer[i] = 0;
+            // Trails: old deposits fade out instead of being removed, costs the same no matter how long the trails are.
+            // Faded below half a tone map step they are dropped, or they would stay lit forever
+            float* density = _particleBuffer.get();
+            const float decay = _trailDecay;
+            const float cutoff = 0.5f / _exposure;
+            for (size_t i = 0; i < pixelCount; i++) {
+                const float faded = density[i] * decay;
+                density[i] = (faded >= cutoff) ? faded : 0.0f;
             }
         }
 
+        // Fraction of the density that survives a frame, 0 disables trails
+        void setTrailDecay(float decay) {
+            _trailDecay = std::clamp(decay, 0.0f, 0.999f);
+        }
+
+        float getTrailDecay() const {
+            return _trailDecay;
+        }
+
         double calculateRadius(const Position& turnedPosition, double radius) const {
             const double screenParticleDelta = turnedPosition.z - camera.getDisplaySurface().z;
-            double out = radius * (500 / screenParticleDelta) * std::tan(camera.getFov() / 2);
-            return out;
+            return radius * camera.getRadiusFactor() / screenParticleDelta;
         }
 
         void setParticle(const Particle& particle) const {
-            const Position turnedPosition = camera.turn(particle.position());
-            if (turnedPosition.z < camera.getDisplaySurface().z) {
-                return;
-            }
+            rasterize(project(particle), Tile(Vector2u(0, 0), _renderSize));
+        }
 
-            const Vector2d particleProjectedPosition = camera.project(turnedPosition);
+        /*
+         * Three stages, each one parallel:
+         * 1. Project every particle, batched through Camera::projectAll
+         * 2. Sort them into the screen tiles their bounding box touches, every chunk of particles has its own bins
+         * 3. Rasterize every tile on its own, no two threads ever write the same pixel
+         */
+        void setParticles(const std::vector<Particle>& particles) {
+            _projected.resize(particles.size());
+            _positions.resize(particles.size());
+            splitIntoChunks();
+
+            ThreadPool::global().parallelFor(0, _chunks.size(), [this, &particles](size_t chunk) {
+                const Tracer::Scope trace("project + bin chunk");
+                projectParticles(particles, _chunks[chunk]);
+                binParticles(_chunks[chunk]);
+            }, 1);
+
+            rasterizeTiles();
+        }
 
-            double projectedRadius = calculateRadius(turnedPosition, particle.radius());
+        /*
+         * Walks the octree from the root and skips every cell outside of the view frustum together with its children.
+         * Level of detail: cells that appear smaller than lodPixelSize are splatted once with the mass of all their particles,
+         * so the cost depends on the resolution and not on the particle count. A lodPixelSize of 0 renders every particle.
+         */
+        void setTree(const BarnesHut& tree, double lodPixelSize = 1.0) {
+            _projected.clear();
+            const Vector2d screenSize(_size.x, _size.y);
+
+            tree.traverse([this, lodPixelSize, &screenSize](const Node& node) {
+                // No particle of a cell is heavier than the whole cell, so none reaches further out of it than the radius of that mass
+                const double mass = node.isLeaf() ? node.particle->mass() : node.mass;
+                const Vector3d reach = Vector3d(1.0, 1.0, 1.0) * Particle::radiusForMass(mass);
+                if (!camera.isBoxVisible(node.from - reach, node.to + reach, screenSize, _cullingMargin)) {
+                    return false;
+                }
 
-            if (projectedRadius <= 1) {
-                if (isOutOfBounds(particleProjectedPosition)) {
-                    return;
+                if (node.isLeaf()) {
+                    if (node.particle != nullptr) {
+                        _projected.push_back(project(*node.particle));
+                    }
+                    return false;
                 }
 
-                const size_t index = to1dim(particleProjectedPosition);
-                if (_particleBuffer[index] < std::numeric_limits<uint8_t>::max()) {
-                    _particleBuffer[index]++;
+                const Vector3d halfCell = (node.to - node.from) / 2.0;
+                const double halfDiagonal = halfCell.length();
+                const Position turnedCellCenter = camera.turn(node.from + halfCell);
+                const double nearestDistance = (turnedCellCenter.z - camera.getDisplaySurface().z) - halfDiagonal;
+                if (nearestDistance <= 0) {
+                    return true; // Cell reaches through the display surface
                 }
-            } else {
-                for (int y = -projectedRadius; y < projectedRadius; y++) {
-                    const int to_x = (int)std::sqrt(projectedRadius * projectedRadius - y * y);
-                    for (int x = -to_x; x < to_x; x++) {
-                        const Vector2d coord = Vector2d(x, y) + particleProjectedPosition;
-                        if (isOutOfBounds(coord)) {
-                            continue;
-                        }
-
-                        const size_t index = to1dim(coord);
-                        if (_particleBuffer[index] < std::numeric_limits<uint8_t>::max()) {
-                            _particleBuffer[index]++;
-                        }
-                    }
+
+                const double projectedSize = 2 * halfDiagonal * camera.getRadiusFactor() / nearestDistance * _renderScale;
+                if (projectedSize >= lodPixelSize) {
+                    return true;
                 }
-            }
-        }
 
-        void setPixel(const Vector2d& coord, const Color& color) const {
-            if (isOutOfBounds(coord)) {
-                return;
-            }
+                _projected.emplace_back(camera.project(camera.turn(node.centerOfMass())) * _renderScale, 0.0, true, static_cast<float>(node.mass));
+                return false;
+            });
+
+            splitIntoChunks();
+            ThreadPool::global().parallelFor(0, _chunks.size(), [this](size_t chunk) {
+                const Tracer::Scope trace("bin chunk");
+                binParticles(_chunks[chunk]);
+            }, 1);
 
-            _pixelBuffer[to1dim(coord) * 4 + 0] = color.x;
-            _pixelBuffer[to1dim(coord) * 4 + 1] = color.y;
-            _pixelBuffer[to1dim(coord) * 4 + 2] = color.z;
-            _pixelBuffer[to1dim(coord) * 4 + 3] = 255;
+            rasterizeTiles();
         }
 
-        void setPixelLine(const Vector2d& from, const Vector2d& to, const Color& color) const {
-            for (int x = from.x; x < to.x; x++) {
-                for (int y = from.y; y < to.y; y++) {
-                    setPixel(Vector2d(x, y), color);
-                }
-            }
+        // The tone map writes every pixel, so single pixels are drawn over it in the next render() only. Window coordinates
+        void setPixel(const Vector2d& coord, const Color& color) {
+            _overlay.emplace_back(coord, color);
         }
 
         void render(sf::RenderTarget& target) {
-            for (int y = 0; y < _size.y; y++) {
-                for (int x = 0; x < _size.x; x++) {
-                    uint16_t value = _particleBuffer[to1dim(Vector2d(x, y))];
-                    if (value == 0) {
-                        continue;
-                    }
-
-                    const uint8_t c = value * (105.0 / 255.0) + 150;
-
-                    uint8_t rgb[4] = {c, c, c, 255};
+            {
+                const FrameProfiler::ScopedTimer timer(_profiler, Phase::Rasterization);
+                toneMap();
+                drawOverlay();
+            }
 
-                    const Vector2d coords(x, y);
-                    setColor(coords, rgb);
-                    // addBlurr(coords, rgb);
+            {
+                const FrameProfiler::ScopedTimer timer(_profiler, Phase::TextureUpload);
+                if (_recorder != nullptr) {
+                    _recorder->addFrame(_pixelBuffer.get());
                 }
+
+                // Only the rendered part of the texture is updated, the sprite stretches it over the whole window
+                _tex.update(_pixelBuffer.get(), _renderSize.x, _renderSize.y, 0, 0);
             }
 
-            _tex.update(_pixelBuffer.get());
+            const FrameProfiler::ScopedTimer timer(_profiler, Phase::Display);
             _sprite.setTexture(_tex);
+            _sprite.setTextureRect(sf::IntRect(0, 0, _renderSize.x, _renderSize.y));
+            _sprite.setScale(static_cast<float>(_size.x) / _renderSize.x, static_cast<float>(_size.y) / _renderSize.y);
             target.draw(_sprite);
             target.draw(_textField);
         }
 
-        void addBlurr(const Vector2d& coord, uint8_t color[4]) {
-            for (int i = 0; i < 3; i++) {
-                color[i] *= 0.1;
-            }
+        void setProfiler(FrameProfiler* profiler) {
+            _profiler = profiler;
+        }
 
-            for (int i = -1; i <= 1; i++) {
-                for (int j = -1; j <= 1; j++) {
-                    if ((i == 0) and (j == 0)) {
-                        continue;
-                    }
+        // Density that maps to full brightness is 255 / exposure
+        void setExposure(float exposure) {
+            _exposure = exposure;
+        }
+
+        float getExposure() const {
+            return _exposure;
+        }
 
-                    setColor(coord + Vector2d(i, j), color);
+        void setToneCurve(ToneCurve curve) {
+            _toneCurve = curve;
+
+            constexpr double maxValue = std::numeric_limits<uint8_t>::max();
+            constexpr double asinhSoftening = 8.0;
+            constexpr double brightnessRange = 255.0 - _minParticleBrightness;
+
+            _toneMap[0] = 0; // Fully transparent, the window clear color shows through
+            for (size_t value = 1; value < _toneMap.size(); value++) {
+                double normalized = 0.0;
+                switch (curve) {
+                    case ToneCurve::Linear:
+                        normalized = value / maxValue;
+                        break;
+                    case ToneCurve::Log:
+                        normalized = std::log1p(value) / std::log1p(maxValue);
+                        break;
+                    case ToneCurve::Asinh:
+                        normalized = std::asinh(value / asinhSoftening) / std::asinh(maxValue / asinhSoftening);
+                        break;
                 }
+
+                const uint8_t c = static_cast<uint8_t>(normalized * brightnessRange + _minParticleBrightness);
+                const uint8_t rgba[4] = {c, c, c, 255};
+                std::memcpy(&_toneMap[value], rgba, sizeof(rgba));
+            }
+        }
+
+        ToneCurve getToneCurve() const {
+            return _toneCurve;
+        }
+
+        void setRecorder(Recorder* recorder) {
+            _recorder = recorder;
+            if (_recorder != nullptr) {
+                setRenderScale(1.0); // Recordings are always made at full resolution
+            }
+        }
+
+        // 0 disables the dynamic resolution
+        void setTargetFrameTime(std::chrono::duration<double, std::milli> frameTime) {
+            _targetFrameTime = frameTime;
+            if (_targetFrameTime.count() <= 0) {
+                setRenderScale(1.0);
             }
         }
 
-        void setColor(const Vector2d& coord, uint8_t color[4]) {
-            if (isOutOfBounds(coord)) {
+        /*
+         * Dynamic resolution: renders into a smaller part of the buffers when frames take longer than the target
+         * and goes back to full resolution once there is time left. Only one change every few frames, so it doesn't oscillate.
+         */
+        void adaptRenderScale(std::chrono::duration<double, std::milli> frameTime) {
+            if ((_targetFrameTime.count() <= 0) or (_recorder != nullptr)) {
                 return;
             }
 
-            const size_t wideCoord = to1dim(coord) * 4;
-            for (int i = 0; i < 4; i++) {
-                const uint16_t c = _pixelBuffer[wideCoord + i] + color[i];
-                if (c <= 255) {
-                    _pixelBuffer[wideCoord + i] = c;
-                }
+            _averageFrameTime = (_averageFrameTime.count() <= 0) ? frameTime : (_averageFrameTime * 0.8 + frameTime * 0.2);
+            if (++_framesSinceRescale < _rescaleCooldown) {
+                return;
             }
+
+            const double load = _averageFrameTime / _targetFrameTime;
+            if (load > 1.05) {
+                setRenderScale(_renderScale * std::max(0.8, std::sqrt(1.0 / load)));
+            } else if (load < 0.8) {
+                setRenderScale(_renderScale * 1.1);
+            }
+        }
+
+        double getRenderScale() const {
+            return _renderScale;
+        }
+
+        const Vector2u& getSize() const {
+            return _size;
         }
 
         void setText(const std::string& text) {
@@ -161,15 +289,35 @@ class Picture {
         }
 
         bool isOutOfBounds(const Vector2d& pixel) const {
-            return (pixel.x < 0) or (pixel.x >= _size.x) or (pixel.y < 0) or (pixel.y >= _size.y);
+            return (pixel.x < 0) or (pixel.x >= _renderSize.x) or (pixel.y < 0) or (pixel.y >= _renderSize.y);
         }
 
         size_t to1dim(const Vector2d& coord) const {
-            return static_cast<size_t>(coord.x) + static_cast<size_t>(coord.y) * _size.x;
+            return static_cast<size_t>(coord.x) + static_cast<size_t>(coord.y) * _renderSize.x;
         }
 
     private:
+        // Scratch space for Camera::projectAll, world space in, screen space out
+        struct SoAPositions {
+                std::vector<double> x, y, z, radius;
+                std::vector<double> screen_x, screen_y, screenRadius;
+
+                void resize(size_t size) {
+                    for (std::vector<double>* v : {&x, &y, &z, &radius, &screen_x, &screen_y, &screenRadius}) {
+                        v->resize(size);
+                    }
+                }
+        };
+
+        struct ParticleChunk {
+                size_t begin = 0;
+                size_t end = 0;
+                std::vector<std::vector<uint32_t>> bins; // Particle indices per tile
+        };
+
         static constexpr uint8_t _minParticleBrightness = 150;
+        static constexpr uint16_t _tileSize = 64;
+        static constexpr double _cullingMargin = 16.0; // Pixels, particles move a bit after the tree was built, their radius is added in world space
 
         Vector2u _size;
         size_t _pixelsSize;
@@ -179,5 +327,228 @@ class Picture {
         sf::Texture _tex;
         sf::Sprite _sprite;
         std::unique_ptr<sf::Uint8[]> _pixelBuffer;
-        std::unique_ptr<uint16_t[]> _particleBuffer;
+        std::unique_ptr<float[]> _particleBuffer; // Accumulated mass per pixel
+        Recorder* _recorder = nullptr;
+        FrameProfiler* _profiler = nullptr;
+
+        ToneCurve _toneCurve = ToneCurve::Linear;
+        std::array<uint32_t, 256> _toneMap{}; // Packed RGBA per exposed density
+        float _exposure = 1.0f;
+        float _trailDecay = 0.0f;
+
+        static constexpr double _minRenderScale = 0.25;
+        static constexpr int _rescaleCooldown = 10;
+        Vector2u _renderSize; // Part of the buffers in use, rows are _renderSize.x wide
+        double _renderScale = 1.0;
+        std::chrono::duration<double, std::milli> _targetFrameTime{0};
+        std::chrono::duration<double, std::milli> _averageFrameTime{0};
+        int _framesSinceRescale = 0;
+        KernelStamps _stamps;
+
+        std::vector<Tile> _tiles;
+        std::vector<ParticleChunk> _chunks;
+        std::vector<ProjectedParticle> _projected;
+        std::vector<std::pair<Vector2d, Color>> _overlay; // Pixels of setPixel until the next render
+        SoAPositions _positions;
+
+        // One pass, no bounds checks and no branches: density -> exposure -> lookup table -> RGBA.
+        // Rounded up, a particle whose mass is spread over a few pixels still lights at least one of them
+        void toneMap() {
+            const size_t pixelCount = static_cast<size_t>(_renderSize.x) * _renderSize.y;
+            const float* density = _particleBuffer.get();
+            sf::Uint8* pixels = _pixelBuffer.get();
+            const float maxIndex = _toneMap.size() - 1;
+
+            for (size_t i = 0; i < pixelCount; i++) {
+                const size_t index = static_cast<size_t>(std::min(std::ceil(density[i] * _exposure), maxIndex));
+                std::memcpy(pixels + i * 4, &_toneMap[index], sizeof(uint32_t));
+            }
+        }
+
+        void drawOverlay() {
+            for (const auto& [coord, color] : _overlay) {
+                const Vector2d pixel = coord * _renderScale;
+                if (!isOutOfBounds(pixel)) {
+                    const uint8_t rgba[4] = {color.x, color.y, color.z, 255};
+                    std::memcpy(_pixelBuffer.get() + to1dim(pixel) * 4, rgba, sizeof(rgba));
+                }
+            }
+            _overlay.clear();
+        }
+
+        void setRenderScale(double scale) {
+            _renderScale = std::clamp(scale, _minRenderScale, 1.0);
+            _framesSinceRescale = 0;
+
+            const Vector2u renderSize(std::max<uint16_t>(1, _size.x * _renderScale), std::max<uint16_t>(1, _size.y * _renderScale));
+            if ((renderSize.x == _renderSize.x) and (renderSize.y == _renderSize.y)) {
+                return;
+            }
+
+            _renderSize = renderSize;
+            std::memset(_particleBuffer.get(), 0, static_cast<size_t>(_size.x) * _size.y * sizeof(float)); // Trails don't fit the new layout
+            createTiles();
+        }
+
+        void createTiles() {
+            _tiles.clear();
+            for (uint16_t y = 0; y < _renderSize.y; y += _tileSize) {
+                for (uint16_t x = 0; x < _renderSize.x; x += _tileSize) {
+                    const uint16_t to_x = std::min<uint16_t>(x + _tileSize, _renderSize.x);
+                    const uint16_t to_y = std::min<uint16_t>(y + _tileSize, _renderSize.y);
+                    _tiles.emplace_back(Vector2u(x, y), Vector2u(to_x, to_y));
+                }
+            }
+
+            _chunks.resize(ThreadPool::global().threadCount());
+            for (ParticleChunk& chunk : _chunks) {
+                chunk.bins.resize(_tiles.size());
+            }
+        }
+
+        ProjectedParticle project(const Particle& particle) const {
+            if (!particle.isEnabled()) {
+                return {};
+            }
+
+            const Position turnedPosition = camera.turn(particle.position());
+            if (turnedPosition.z < camera.getDisplaySurface().z) {
+                return {};
+            }
+
+            const Vector2d position = camera.project(turnedPosition) * _renderScale;
+            return {position, calculateRadius(turnedPosition, particle.radius()) * _renderScale, true, static_cast<float>(particle.mass())};
+        }
+
+        void splitIntoChunks() {
+            const size_t chunkSize = (_projected.size() / _chunks.size()) + 1;
+            for (size_t i = 0; i < _chunks.size(); i++) {
+                _chunks[i].begin = std::min(i * chunkSize, _projected.size());
+                _chunks[i].end = std::min((i + 1) * chunkSize, _projected.size());
+            }
+        }
+
+        void rasterizeTiles() {
+            ThreadPool::global().parallelFor(0, _tiles.size(), [this](size_t tileIndex) {
+                const Tracer::Scope trace("raster tile");
+                for (const ParticleChunk& chunk : _chunks) {
+                    for (uint32_t particleIndex : chunk.bins[tileIndex]) {
+                        rasterize(_projected[particleIndex], _tiles[tileIndex]);
+                    }
+                }
+            }, 1);
+        }
+
+        void projectParticles(const std::vector<Particle>& particles, const ParticleChunk& chunk) {
+            const size_t count = chunk.end - chunk.begin;
+            SoAPositions& pos = _positions;
+
+            for (size_t i = chunk.begin; i < chunk.end; i++) {
+                const Particle& particle = particles[i];
+                pos.x[i] = particle.position().x;
+                pos.y[i] = particle.position().y;
+                pos.z[i] = particle.position().z;
+                pos.radius[i] = particle.isEnabled() ? particle.radius() : 0.0;
+                _projected[i].weight = static_cast<float>(particle.mass());
+            }
+
+            camera.projectAll(std::span(pos.x).subspan(chunk.begin, count), std::span(pos.y).subspan(chunk.begin, count), std::span(pos.z).subspan(chunk.begin, count),
+                std::span(pos.radius).subspan(chunk.begin, count), std::span(pos.screen_x).subspan(chunk.begin, count), std::span(pos.screen_y).subspan(chunk.begin, count),
+                std::span(pos.screenRadius).subspan(chunk.begin, count));
+
+            for (size_t i = chunk.begin; i < chunk.end; i++) {
+                const bool visible = particles[i].isEnabled() and (pos.screenRadius[i] >= 0.0);
+                const Vector2d position = Vector2d(pos.screen_x[i], pos.screen_y[i]) * _renderScale;
+                _projected[i] = ProjectedParticle(position, pos.screenRadius[i] * _renderScale, visible, _projected[i].weight);
+            }
+        }
+
+        void binParticles(ParticleChunk& chunk) const {
+            const size_t tilesPerRow = (_renderSize.x + _tileSize - 1) / _tileSize;
+
+            for (std::vector<uint32_t>& bin : chunk.bins) {
+                bin.clear();
+            }
+
+            for (size_t i = chunk.begin; i < chunk.end; i++) {
+                const ProjectedParticle& particle = _projected[i];
+                if (!particle.visible) {
+                    continue;
+                }
+
+                const double extent = KernelStamps::extent(particle.radius);
+                const double from_x = std::max(0.0, std::floor(particle.position.x - extent));
+                const double from_y = std::max(0.0, std::floor(particle.position.y - extent));
+                const double to_x = std::min(_renderSize.x - 1.0, std::floor(particle.position.x + extent));
+                const double to_y = std::min(_renderSize.y - 1.0, std::floor(particle.position.y + extent));
+                if ((from_x > to_x) or (from_y > to_y)) {
+                    continue;
+                }
+
+                for (size_t tile_y = from_y / _tileSize; tile_y <= to_y / _tileSize; tile_y++) {
+                    for (size_t tile_x = from_x / _tileSize; tile_x <= to_x / _tileSize; tile_x++) {
+                        chunk.bins[tile_y * tilesPerRow + tile_x].push_back(static_cast<uint32_t>(i));
+                    }
+                }
+            }
+        }
+
+        // Deposits the mass of the particle with a gaussian kernel, only touches pixels inside of the clip rectangle
+        void rasterize(const ProjectedParticle& particle, const Tile& clip) const {
+            if (!particle.visible) {
+                return;
+            }
+
+            const Vector2d& center = particle.position;
+            const int reach = KernelStamps::extent(particle.radius);
+            if ((center.x + reach < clip.from.x) or (center.x - reach >= clip.to.x) or (center.y + reach < clip.from.y) or (center.y - reach >= clip.to.y)) {
+                return;
+            }
+
+            const int pixel_x = static_cast<int>(std::floor(center.x));
+            const int pixel_y = static_cast<int>(std::floor(center.y));
+
+            if (!_stamps.hasStamp(particle.radius)) {
+                rasterizeLarge(particle, clip, pixel_x, pixel_y, reach);
+                return;
+            }
+
+            const KernelStamps::Stamp& stamp = _stamps.get(particle.radius, center);
+            const int stamp_x = pixel_x + stamp.from_x;
+            const int stamp_y = pixel_y + stamp.from_y;
+            const int from_x = std::max<int>(stamp_x, clip.from.x);
+            const int to_x = std::min<int>(stamp_x + stamp.width, clip.to.x);
+            const int from_y = std::max<int>(stamp_y, clip.from.y);
+            const int to_y = std::min<int>(stamp_y + stamp.height, clip.to.y);
+            const float weight = particle.weight;
+
+            for (int y = from_y; y < to_y; y++) {
+                const float* source = _stamps.weights(stamp) + static_cast<size_t>(y - stamp_y) * stamp.width + (from_x - stamp_x);
+                float* row = _particleBuffer.get() + static_cast<size_t>(y) * _renderSize.x + from_x;
+                for (int x = 0; x < to_x - from_x; x++) {
+                    row[x] += source[x] * weight;
+                }
+            }
+        }
+
+        // Too big for a precomputed stamp, only happens for particles right in front of the camera
+        void rasterizeLarge(const ProjectedParticle& particle, const Tile& clip, int pixel_x, int pixel_y, int reach) const {
+            const double sigma = KernelStamps::sigmaForRadius(particle.radius);
+            const double support = KernelStamps::supportInSigma;
+            const double normalization = 2 * std::numbers::pi * sigma * sigma * (1 - std::exp(-support * support / 2));
+            const Vector2d centerInPixel(particle.position.x - pixel_x, particle.position.y - pixel_y);
+
+            const int from_x = std::max<int>(pixel_x - reach, clip.from.x);
+            const int to_x = std::min<int>(pixel_x + reach + 1, clip.to.x);
+            const int from_y = std::max<int>(pixel_y - reach, clip.from.y);
+            const int to_y = std::min<int>(pixel_y + reach + 1, clip.to.y);
+
+            for (int y = from_y; y < to_y; y++) {
+                float* row = _particleBuffer.get() + static_cast<size_t>(y) * _renderSize.x;
+                for (int x = from_x; x < to_x; x++) {
+                    const double kernel = KernelStamps::evaluate(sigma, centerInPixel, x - pixel_x, y - pixel_y);
+                    row[x] += static_cast<float>(kernel / normalization * particle.weight);
+                }
+            }
+        }
 };
\ No newline at end of file
@@ -0,0 +1,238 @@
+#pragma once
+
+#include "BoundedQueue.h"
+#include "Vector.h"
+
+#include <array>
+#include <atomic>
+#include <cstring>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+enum class RecordingFormat {
+    Y4M, // One uncompressed YUV 4:4:4 video file
+    QOI  // One .qoi image per frame inside a directory
+};
+
+enum class Backpressure {
+    DropFrame, // Simulation never waits, frames are lost if the disk can't keep up
+    Block      // Every frame is written, simulation waits for the encoder
+};
+
+/*
+ * Takes the RGBA pixel buffer of every frame and encodes it on a background thread.
+ * Frame buffers are recycled, after warm up no allocations happen per frame.
+ */
+class Recorder {
+        using Frame = std::vector<uint8_t>;
+
+    public:
+        // Throws std::runtime_error if the video file or a frame in the directory can't be written
+        Recorder(const std::filesystem::path& path, Vector2u size, RecordingFormat format, Backpressure backpressure = Backpressure::DropFrame, unsigned fps = 60, size_t queueCapacity = 8) :
+                _path(path),
+                _size(size),
+                _format(format),
+                _backpressure(backpressure),
+                _fps(fps),
+                _frames(queueCapacity),
+                _freeFrames(queueCapacity + 1) {
+            if (_format == RecordingFormat::QOI) {
+                std::filesystem::create_directories(_path);
+                // The first frame goes there, an existing directory may still be read only
+                if (!std::ofstream(framePath(0), std::ios::binary)) {
+                    throw std::runtime_error(std::format("Can't write frames into {}", _path.string()));
+                }
+                std::filesystem::remove(framePath(0));
+            } else {
+                _video.open(_path, std::ios::binary);
+                _video << std::format("YUV4MPEG2 W{} H{} F{}:1 Ip A1:1 C444\n", _size.x, _size.y, _fps);
+                if (!_video) {
+                    throw std::runtime_error(std::format("Can't write the video {}", _path.string()));
+                }
+            }
+
+            _encoder = std::thread([this]() {
+                encode();
+            });
+        }
+
+        Recorder(const Recorder&) = delete;
+        Recorder& operator=(const Recorder&) = delete;
+
+        ~Recorder() {
+            _frames.close();
+            _encoder.join();
+        }
+
+        void addFrame(const uint8_t* rgba) {
+            Frame frame = _freeFrames.tryPop().value_or(Frame());
+            frame.resize(static_cast<size_t>(_size.x) * _size.y * 4);
+            std::memcpy(frame.data(), rgba, frame.size());
+
+            if (_backpressure == Backpressure::Block) {
+                _frames.push(std::move(frame));
+            } else if (!_frames.tryPush(frame)) {
+                _droppedFrames++;
+                _freeFrames.tryPush(frame);
+            }
+        }
+
+        size_t writtenFrames() const {
+            return _writtenFrames;
+        }
+
+        // Also the frames that could not be written
+        size_t droppedFrames() const {
+            return _droppedFrames;
+        }
+
+        size_t pendingFrames() const {
+            return _frames.size();
+        }
+
+    private:
+        const std::filesystem::path _path;
+        const Vector2u _size;
+        const RecordingFormat _format;
+        const Backpressure _backpressure;
+        const unsigned _fps;
+
+        BoundedQueue<Frame> _frames;
+        BoundedQueue<Frame> _freeFrames;
+        std::atomic<size_t> _writtenFrames = 0;
+        std::atomic<size_t> _droppedFrames = 0;
+
+        std::ofstream _video;
+        std::vector<uint8_t> _encodeBuffer;
+        std::thread _encoder;
+
+        void encode() {
+            while (std::optional<Frame> frame = _frames.pop()) {
+                const bool written = (_format == RecordingFormat::QOI) ? writeQoi(*frame) : writeY4m(*frame);
+                if (written) {
+                    _writtenFrames++;
+                } else {
+                    _droppedFrames++;
+                }
+                _freeFrames.tryPush(*frame);
+            }
+
+            _video.flush();
+        }
+
+        std::filesystem::path framePath(size_t frame) const {
+            return _path / std::format("frame_{:06}.qoi", frame);
+        }
+
+        // Once a write failed the stream stays failed, every frame after it is dropped
+        bool writeY4m(const Frame& rgba) {
+            // BT.601 studio swing, planar Y, Cb, Cr
+            const size_t pixelCount = static_cast<size_t>(_size.x) * _size.y;
+            _encodeBuffer.resize(pixelCount * 3);
+            uint8_t* yPlane = _encodeBuffer.data();
+            uint8_t* uPlane = yPlane + pixelCount;
+            uint8_t* vPlane = uPlane + pixelCount;
+
+            for (size_t i = 0; i < pixelCount; i++) {
+                const int r = rgba[i * 4 + 0];
+                const int g = rgba[i * 4 + 1];
+                const int b = rgba[i * 4 + 2];
+
+                yPlane[i] = static_cast<uint8_t>(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+                uPlane[i] = static_cast<uint8_t>(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+                vPlane[i] = static_cast<uint8_t>(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+            }
+
+            _video << "FRAME\n";
+            _video.write(reinterpret_cast<const char*>(_encodeBuffer.data()), _encodeBuffer.size());
+            return !_video.fail();
+        }
+
+        bool writeQoi(const Frame& rgba) {
+            // https://qoiformat.org/qoi-specification.pdf
+            constexpr uint8_t QOI_OP_INDEX = 0x00;
+            constexpr uint8_t QOI_OP_DIFF = 0x40;
+            constexpr uint8_t QOI_OP_LUMA = 0x80;
+            constexpr uint8_t QOI_OP_RUN = 0xc0;
+            constexpr uint8_t QOI_OP_RGB = 0xfe;
+            constexpr uint8_t QOI_OP_RGBA = 0xff;
+
+            _encodeBuffer.clear();
+            auto put32 = [this](uint32_t value) {
+                for (int shift = 24; shift >= 0; shift -= 8) {
+                    _encodeBuffer.push_back(static_cast<uint8_t>(value >> shift));
+                }
+            };
+
+            _encodeBuffer.insert(_encodeBuffer.end(), {'q', 'o', 'i', 'f'});
+            put32(_size.x);
+            put32(_size.y);
+            _encodeBuffer.push_back(3); // channels, the frame is opaque like the window
+            _encodeBuffer.push_back(0); // sRGB with linear alpha
+
+            std::array<std::array<uint8_t, 4>, 64> seen{};
+            std::array<uint8_t, 4> previous = {0, 0, 0, 255};
+            int run = 0;
+
+            const size_t pixelCount = static_cast<size_t>(_size.x) * _size.y;
+            for (size_t i = 0; i < pixelCount; i++) {
+                // Over the black the window is cleared with, transparent background turns black instead of see-through
+                const int alpha = rgba[i * 4 + 3];
+                const std::array<uint8_t, 4> pixel = {static_cast<uint8_t>(rgba[i * 4 + 0] * alpha / 255), static_cast<uint8_t>(rgba[i * 4 + 1] * alpha / 255),
+                    static_cast<uint8_t>(rgba[i * 4 + 2] * alpha / 255), 255};
+
+                if (pixel == previous) {
+                    run++;
+                    if ((run == 62) or (i == pixelCount - 1)) {
+                        _encodeBuffer.push_back(QOI_OP_RUN | (run - 1));
+                        run = 0;
+                    }
+                    continue;
+                }
+
+                if (run > 0) {
+                    _encodeBuffer.push_back(QOI_OP_RUN | (run - 1));
+                    run = 0;
+                }
+
+                const size_t hash = (pixel[0] * 3 + pixel[1] * 5 + pixel[2] * 7 + pixel[3] * 11) % 64;
+                if (seen[hash] == pixel) {
+                    _encodeBuffer.push_back(QOI_OP_INDEX | static_cast<uint8_t>(hash));
+                } else {
+                    seen[hash] = pixel;
+
+                    if (pixel[3] == previous[3]) {
+                        const int8_t dr = static_cast<int8_t>(pixel[0] - previous[0]);
+                        const int8_t dg = static_cast<int8_t>(pixel[1] - previous[1]);
+                        const int8_t db = static_cast<int8_t>(pixel[2] - previous[2]);
+                        const int dr_dg = dr - dg;
+                        const int db_dg = db - dg;
+
+                        if ((dr > -3) and (dr < 2) and (dg > -3) and (dg < 2) and (db > -3) and (db < 2)) {
+                            _encodeBuffer.push_back(QOI_OP_DIFF | ((dr + 2) << 4) | ((dg + 2) << 2) | (db + 2));
+                        } else if ((dg > -33) and (dg < 32) and (dr_dg > -9) and (dr_dg < 8) and (db_dg > -9) and (db_dg < 8)) {
+                            _encodeBuffer.push_back(QOI_OP_LUMA | (dg + 32));
+                            _encodeBuffer.push_back(((dr_dg + 8) << 4) | (db_dg + 8));
+                        } else {
+                            _encodeBuffer.insert(_encodeBuffer.end(), {QOI_OP_RGB, pixel[0], pixel[1], pixel[2]});
+                        }
+                    } else {
+                        _encodeBuffer.insert(_encodeBuffer.end(), {QOI_OP_RGBA, pixel[0], pixel[1], pixel[2], pixel[3]});
+                    }
+                }
+
+                previous = pixel;
+            }
+
+            _encodeBuffer.insert(_encodeBuffer.end(), {0, 0, 0, 0, 0, 0, 0, 1});
+
+            std::ofstream file(framePath(_writtenFrames), std::ios::binary);
+            file.write(reinterpret_cast<const char*>(_encodeBuffer.data()), _encodeBuffer.size());
+            file.close();
+            return !file.fail();
+        }
+};
\ No newline at end of file
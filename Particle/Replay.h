@@ -0,0 +1,218 @@
+#pragma once
+
+#include "Trajectory.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <exception>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+struct ReplayFrame {
+        uint64_t step = 0;
+        std::vector<Position> positions;
+        std::vector<float> masses;
+};
+
+/*
+ * Plays a recorded trajectory at a constant rate of frames per second, forwards or backwards, with seeking.
+ * A prefetch thread decodes the frames ahead in the direction of playback, so playing only costs a lookup.
+ * Frames that are not prefetched yet (after a seek) are decoded on the calling thread.
+ */
+class ReplayPlayer {
+        using Clock = std::chrono::steady_clock;
+
+    public:
+        explicit ReplayPlayer(const std::filesystem::path& path, double framesPerSecond = 60.0, size_t prefetchFrames = 32) :
+                _reader(path),
+                _decoder(_reader),
+                _rate(framesPerSecond),
+                _prefetchFrames(prefetchFrames) {
+            if (_reader.frameCount() == 0) {
+                throw std::runtime_error(std::format("{} has no frames", path.string()));
+            }
+
+            _prefetcher = std::thread([this]() {
+                prefetch();
+            });
+        }
+
+        ReplayPlayer(const ReplayPlayer&) = delete;
+        ReplayPlayer& operator=(const ReplayPlayer&) = delete;
+
+        ~ReplayPlayer() {
+            {
+                std::lock_guard lock(_mutex);
+                _stopped = true;
+            }
+            _wake.notify_one();
+            _prefetcher.join();
+        }
+
+        // Moves on by the time since the last call, playback stops at either end. The first call shows the first frame.
+        // Throws std::runtime_error for a corrupt frame, also for one the prefetcher ran into
+        std::shared_ptr<const ReplayFrame> update() {
+            const Clock::time_point now = Clock::now();
+            if (!_paused and _lastUpdate.has_value()) {
+                _position += _rate * std::chrono::duration<double>(now - *_lastUpdate).count();
+            }
+            _position = std::clamp(_position, 0.0, static_cast<double>(frameCount() - 1));
+            _lastUpdate = now;
+
+            const size_t frame = currentFrame();
+            {
+                std::lock_guard lock(_mutex);
+                rethrowPrefetchError();
+                _wanted = Request(frame, _rate >= 0.0);
+            }
+            _wake.notify_one();
+            return get(frame);
+        }
+
+        void seek(size_t frame) {
+            _position = static_cast<double>(std::min(frame, frameCount() - 1));
+        }
+
+        void seekRelative(ptrdiff_t frames) {
+            seek(static_cast<size_t>(std::max<ptrdiff_t>(0, static_cast<ptrdiff_t>(currentFrame()) + frames)));
+        }
+
+        // Frames per second, negative plays backwards
+        void setRate(double framesPerSecond) {
+            _rate = framesPerSecond;
+        }
+
+        double getRate() const {
+            return _rate;
+        }
+
+        void setPaused(bool paused) {
+            _paused = paused;
+        }
+
+        bool isPaused() const {
+            return _paused;
+        }
+
+        size_t currentFrame() const {
+            return static_cast<size_t>(_position);
+        }
+
+        size_t frameCount() const {
+            return _reader.frameCount();
+        }
+
+    private:
+        struct Request {
+                size_t frame = 0;
+                bool forwards = true;
+
+                bool operator==(const Request& other) const = default;
+        };
+
+        TrajectoryReader _reader;
+        TrajectoryDecoder _decoder; // Of the calling thread, the prefetcher has its own
+        double _rate;
+        const size_t _prefetchFrames;
+        double _position = 0.0;
+        bool _paused = false;
+        std::optional<Clock::time_point> _lastUpdate;
+
+        std::mutex _mutex;
+        std::condition_variable _wake;
+        std::map<size_t, std::shared_ptr<const ReplayFrame>> _frames; // Decoded around the current frame
+        Request _wanted;
+        std::optional<Request> _prefetched;
+        std::exception_ptr _error; // Ended the prefetcher, thrown again on the calling thread
+        bool _stopped = false;
+        std::thread _prefetcher;
+
+        std::shared_ptr<const ReplayFrame> get(size_t frame) {
+            {
+                std::lock_guard lock(_mutex);
+                rethrowPrefetchError();
+                if (const auto found = _frames.find(frame); found != _frames.end()) {
+                    return found->second;
+                }
+            }
+
+            std::shared_ptr<const ReplayFrame> decoded = decode(_decoder, frame);
+            std::lock_guard lock(_mutex);
+            _frames.emplace(frame, decoded);
+            return decoded;
+        }
+
+        std::shared_ptr<const ReplayFrame> decode(TrajectoryDecoder& decoder, size_t frame) const {
+            std::shared_ptr<ReplayFrame> decoded = std::make_shared<ReplayFrame>();
+            decoder.decode(frame, decoded->positions, decoded->masses);
+            decoded->step = _reader.entry(frame).step;
+            return decoded;
+        }
+
+        // Only while _mutex is held
+        void rethrowPrefetchError() const {
+            if (_error) {
+                std::rethrow_exception(_error);
+            }
+        }
+
+        // A corrupt file must not terminate the program from another thread, the error is handed to the calling thread
+        void prefetch() {
+            try {
+                prefetchWindows();
+            } catch (...) {
+                std::lock_guard lock(_mutex);
+                _error = std::current_exception();
+            }
+        }
+
+        void prefetchWindows() {
+            TrajectoryDecoder decoder(_reader);
+
+            std::unique_lock lock(_mutex);
+            while (true) {
+                _wake.wait(lock, [this]() {
+                    return _stopped or (_prefetched != _wanted);
+                });
+                if (_stopped) {
+                    return;
+                }
+
+                // Backwards the window starts at a keyframe, so a whole group of frames is decoded in one pass.
+                // Starting anywhere else, every frame would cost a decode from its keyframe on
+                const Request request = _wanted;
+                const size_t last = frameCount() - 1;
+                const size_t from = request.forwards ? request.frame : _reader.entry(request.frame - std::min(request.frame, _prefetchFrames)).keyframe;
+                const size_t to = request.forwards ? std::min(last, request.frame + _prefetchFrames) : request.frame;
+
+                // Frames far outside of the window go first, whatever is left over from a seek is useless
+                std::erase_if(_frames, [from, to, this](const auto& entry) {
+                    return (entry.first + _prefetchFrames < from) or (entry.first > to + _prefetchFrames);
+                });
+
+                // Always decoded forwards, the decoder continues frame by frame
+                for (size_t frame = from; frame <= to; frame++) {
+                    if (_stopped or (_wanted.forwards != request.forwards) or (_wanted.frame < from) or (_wanted.frame > to)) {
+                        break;
+                    }
+                    if (_frames.contains(frame)) {
+                        continue;
+                    }
+
+                    lock.unlock();
+                    std::shared_ptr<const ReplayFrame> decoded = decode(decoder, frame);
+                    lock.lock();
+                    _frames.emplace(frame, std::move(decoded));
+                }
+
+                _prefetched = request;
+            }
+        }
+};
\ No newline at end of file
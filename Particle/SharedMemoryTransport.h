@@ -0,0 +1,388 @@
+#pragma once
+
+#include "Transport.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <format>
+#include <functional>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+/*
+ * Transport between the processes of one machine. Every ordered pair of ranks has a single producer, single consumer
+ * byte ring in one POSIX shared memory object. Messages are streamed through the rings, so they can be larger than a ring,
+ * and allToAll keeps sending and receiving at the same time, so no rank waits on a full ring forever.
+ */
+class SharedMemoryTransport : public Transport {
+        struct Header {
+                static constexpr std::array<char, 8> expectedMagic{'P', 'A', 'R', 'T', 'C', 'O', 'M', '\0'};
+
+                std::array<char, 8> magic{};
+                int32_t size = 0;
+                std::atomic<uint32_t> aborted{0};
+                uint64_t capacity = 0; // Bytes per ring
+        };
+
+        struct Channel {
+                alignas(64) std::atomic<uint64_t> written{0};
+                alignas(64) std::atomic<uint64_t> read{0};
+        };
+
+        // How far a message got, its length is streamed in front of it
+        struct Progress {
+                uint64_t length = 0;
+                size_t done = 0;
+
+                bool finished() const {
+                    return done == sizeof(length) + length;
+                }
+        };
+
+    public:
+        static constexpr size_t defaultCapacity = 1 << 22;
+
+        // Creates the rings of size ranks, which then attach with the constructor. Throws std::runtime_error
+        static void createChannels(const std::string& name, int size, size_t capacity = defaultCapacity) {
+#ifdef _WIN32
+            throw std::runtime_error("The shared memory transport needs POSIX shared memory");
+#else
+            capacity = (capacity + alignof(Channel) - 1) / alignof(Channel) * alignof(Channel); // Keeps every channel aligned
+            const size_t bytes = segmentSize(size, capacity);
+            const int fd = ::shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+            if (fd < 0) {
+                throw std::runtime_error(std::format("Could not create shared memory {}", name));
+            }
+            const bool sized = ::ftruncate(fd, static_cast<off_t>(bytes)) == 0;
+            void* data = sized ? ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+            ::close(fd);
+            if (data == MAP_FAILED) {
+                ::shm_unlink(name.c_str());
+                throw std::runtime_error(std::format("Could not map shared memory {}", name));
+            }
+
+            std::byte* segment = static_cast<std::byte*>(data);
+            Header* header = new (segment) Header();
+            header->size = size;
+            header->capacity = capacity;
+            for (int channel = 0; channel < size * size; channel++) {
+                new (segment + channelOffset(channel, capacity)) Channel();
+            }
+            std::atomic_thread_fence(std::memory_order_release);
+            header->magic = Header::expectedMagic;
+            ::munmap(data, bytes);
+#endif
+        }
+
+        // Ranks that are attached keep working
+        static void removeChannels(const std::string& name) {
+#ifndef _WIN32
+            ::shm_unlink(name.c_str());
+#endif
+        }
+
+        // Throws std::runtime_error if there are no channels with this name
+        SharedMemoryTransport(const std::string& name, int rank) :
+                _rank(rank) {
+#ifdef _WIN32
+            throw std::runtime_error("The shared memory transport needs POSIX shared memory");
+#else
+            const int fd = ::shm_open(name.c_str(), O_RDWR, 0);
+            if (fd < 0) {
+                throw std::runtime_error(std::format("Could not open shared memory {}", name));
+            }
+
+            struct stat status;
+            if (::fstat(fd, &status) != 0) {
+                ::close(fd);
+                throw std::runtime_error(std::format("Could not stat shared memory {}", name));
+            }
+            _bytes = static_cast<size_t>(status.st_size);
+            void* data = (_bytes >= sizeof(Header)) ? ::mmap(nullptr, _bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+            ::close(fd);
+            if (data == MAP_FAILED) {
+                throw std::runtime_error(std::format("Could not map shared memory {}", name));
+            }
+            _segment = static_cast<std::byte*>(data);
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+            const Header& head = header();
+            if ((head.magic != Header::expectedMagic) or (_bytes < segmentSize(head.size, head.capacity)) or (rank < 0) or (rank >= head.size)) {
+                ::munmap(_segment, _bytes);
+                throw std::runtime_error(std::format("{} holds no channels for rank {}", name, rank));
+            }
+            _size = head.size;
+            _capacity = head.capacity;
+#endif
+        }
+
+        SharedMemoryTransport(const SharedMemoryTransport&) = delete;
+        SharedMemoryTransport& operator=(const SharedMemoryTransport&) = delete;
+
+        ~SharedMemoryTransport() override {
+#ifndef _WIN32
+            ::munmap(_segment, _bytes);
+#endif
+        }
+
+        int rank() const override {
+            return _rank;
+        }
+
+        int size() const override {
+            return _size;
+        }
+
+        // Throws std::runtime_error once any rank called abort
+        std::vector<Buffer> allToAll(std::vector<Buffer> outgoing) override {
+            std::vector<Buffer> incoming(_size);
+            incoming[_rank] = std::move(outgoing[_rank]);
+
+            std::vector<Progress> sending(_size);
+            std::vector<Progress> receiving(_size);
+            for (int other = 0; other < _size; other++) {
+                sending[other].length = outgoing[other].size();
+            }
+
+            int pending = 2 * (_size - 1);
+            while (pending > 0) {
+                bool progress = false;
+                for (int other = 0; other < _size; other++) {
+                    if (other == _rank) {
+                        continue;
+                    }
+
+                    if (!sending[other].finished()) {
+                        progress |= send(channel(_rank, other), sending[other], outgoing[other]) > 0;
+                        pending -= sending[other].finished() ? 1 : 0;
+                    }
+                    if (!receiving[other].finished()) {
+                        progress |= receive(channel(other, _rank), receiving[other], incoming[other]) > 0;
+                        pending -= receiving[other].finished() ? 1 : 0;
+                    }
+                }
+
+                if (!progress) {
+                    if (header().aborted.load(std::memory_order_relaxed) != 0) {
+                        throw std::runtime_error("Another rank of the distributed run failed");
+                    }
+                    if ((_idleCheck != nullptr) and ((++_idleRounds % idleCheckInterval) == 0)) {
+                        _idleCheck();
+                    }
+                    std::this_thread::yield();
+                }
+            }
+            return incoming;
+        }
+
+        // Wakes up every rank that waits for this one with an exception
+        void abort() {
+            header().aborted.store(1, std::memory_order_relaxed);
+        }
+
+        /*
+         * Called every so often while waiting for other ranks. A rank killed by a signal never calls abort,
+         * the check can find out and throw instead of waiting forever.
+         */
+        void setIdleCheck(std::function<void()> check) {
+            _idleCheck = std::move(check);
+        }
+
+    private:
+        static constexpr uint64_t idleCheckInterval = 1024; // Rounds without progress
+
+        int _rank = 0;
+        int _size = 0;
+        size_t _capacity = 0;
+        std::byte* _segment = nullptr;
+        size_t _bytes = 0;
+        std::function<void()> _idleCheck;
+        uint64_t _idleRounds = 0;
+
+        static constexpr size_t channelOffset(size_t channel, size_t capacity) {
+            constexpr size_t headerSize = (sizeof(Header) + alignof(Channel) - 1) / alignof(Channel) * alignof(Channel);
+            return headerSize + channel * (sizeof(Channel) + capacity);
+        }
+
+        static constexpr size_t segmentSize(int size, size_t capacity) {
+            return channelOffset(static_cast<size_t>(size) * size, capacity);
+        }
+
+        Header& header() {
+            return *reinterpret_cast<Header*>(_segment);
+        }
+
+        Channel& channel(int from, int to) {
+            return *reinterpret_cast<Channel*>(_segment + channelOffset(static_cast<size_t>(from) * _size + to, _capacity));
+        }
+
+        std::byte* ring(Channel& channel) {
+            return reinterpret_cast<std::byte*>(&channel) + sizeof(Channel);
+        }
+
+        // Copies as much as fits into the ring, returns how much that was
+        size_t push(Channel& channel, const std::byte* data, size_t size) {
+            const uint64_t written = channel.written.load(std::memory_order_relaxed);
+            const uint64_t read = channel.read.load(std::memory_order_acquire);
+            const size_t count = std::min<size_t>(size, _capacity - (written - read));
+
+            const size_t offset = written % _capacity;
+            const size_t first = std::min(count, _capacity - offset);
+            std::memcpy(ring(channel) + offset, data, first);
+            std::memcpy(ring(channel), data + first, count - first);
+            channel.written.store(written + count, std::memory_order_release);
+            return count;
+        }
+
+        // Copies as much as is available from the ring, returns how much that was
+        size_t pull(Channel& channel, std::byte* data, size_t size) {
+            const uint64_t read = channel.read.load(std::memory_order_relaxed);
+            const uint64_t written = channel.written.load(std::memory_order_acquire);
+            const size_t count = std::min<size_t>(size, written - read);
+
+            const size_t offset = read % _capacity;
+            const size_t first = std::min(count, _capacity - offset);
+            std::memcpy(data, ring(channel) + offset, first);
+            std::memcpy(data + first, ring(channel), count - first);
+            channel.read.store(read + count, std::memory_order_release);
+            return count;
+        }
+
+        size_t send(Channel& channel, Progress& progress, const Buffer& message) {
+            size_t moved = 0;
+            if (progress.done < sizeof(uint64_t)) {
+                const size_t count = push(channel, reinterpret_cast<const std::byte*>(&progress.length) + progress.done, sizeof(uint64_t) - progress.done);
+                progress.done += count;
+                moved += count;
+            }
+            if (progress.done >= sizeof(uint64_t)) {
+                const size_t sent = progress.done - sizeof(uint64_t);
+                const size_t count = push(channel, message.data() + sent, message.size() - sent);
+                progress.done += count;
+                moved += count;
+            }
+            return moved;
+        }
+
+        size_t receive(Channel& channel, Progress& progress, Buffer& message) {
+            size_t moved = 0;
+            if (progress.done < sizeof(uint64_t)) {
+                const size_t count = pull(channel, reinterpret_cast<std::byte*>(&progress.length) + progress.done, sizeof(uint64_t) - progress.done);
+                progress.done += count;
+                moved += count;
+                if (progress.done < sizeof(uint64_t)) {
+                    return moved;
+                }
+                message.resize(progress.length);
+            }
+
+            const size_t received = progress.done - sizeof(uint64_t);
+            const size_t count = pull(channel, message.data() + received, message.size() - received);
+            progress.done += count;
+            return moved + count;
+        }
+};
+
+/*
+ * Runs work(transport) on size ranks: rank 0 in this process, the others in forked children, all connected by shared memory.
+ * Returns once every rank is done. Throws std::runtime_error if any rank failed, also by a signal: rank 0 reaps children
+ * that died while it waits for them, and children give up once rank 0 is gone.
+ * The children only have the forking thread, the global thread pool starts over there without workers.
+ */
+template <typename Work>
+void runOnSharedMemory(int size, Work&& work, size_t capacity = SharedMemoryTransport::defaultCapacity) {
+#ifdef _WIN32
+    throw std::runtime_error("Distributed runs need POSIX processes and shared memory");
+#else
+    const std::string name = std::format("/particle_ranks_{}", ::getpid());
+    SharedMemoryTransport::createChannels(name, size, capacity);
+
+    const pid_t parent = ::getpid();
+    std::vector<pid_t> children;
+    for (int rank = 1; rank < size; rank++) {
+        const pid_t pid = ::fork();
+        if (pid == 0) {
+            int exitCode = 0;
+            std::optional<SharedMemoryTransport> transport;
+            try {
+                transport.emplace(name, rank);
+                // Orphans are adopted by another process. Rank 0 can't remove the channels anymore
+                transport->setIdleCheck([parent, &name]() {
+                    if (::getppid() != parent) {
+                        SharedMemoryTransport::removeChannels(name);
+                        throw std::runtime_error("Rank 0 of the distributed run is gone");
+                    }
+                });
+                work(static_cast<Transport&>(*transport));
+            } catch (...) {
+                if (transport.has_value()) {
+                    transport->abort();
+                }
+                exitCode = 1;
+            }
+            ::_exit(exitCode);
+        }
+        if (pid > 0) {
+            children.push_back(pid);
+        }
+    }
+
+    bool failed = children.size() != static_cast<size_t>(size - 1);
+    std::vector<std::optional<int>> statuses(children.size()); // Of the children reaped already
+    const auto succeeded = [](int status) {
+        return WIFEXITED(status) and (WEXITSTATUS(status) == 0);
+    };
+    {
+        SharedMemoryTransport transport(name, 0);
+        transport.setIdleCheck([&children, &statuses, &succeeded]() {
+            for (size_t child = 0; child < children.size(); child++) {
+                int status = 0;
+                if (!statuses[child].has_value() and (::waitpid(children[child], &status, WNOHANG) == children[child])) {
+                    statuses[child] = status;
+                    if (!succeeded(status)) {
+                        throw std::runtime_error(std::format("Rank {} of the distributed run died", child + 1));
+                    }
+                }
+            }
+        });
+        if (failed) {
+            transport.abort();
+        } else {
+            try {
+                work(static_cast<Transport&>(transport));
+            } catch (...) {
+                transport.abort();
+                failed = true;
+            }
+        }
+    }
+
+    for (size_t child = 0; child < children.size(); child++) {
+        if (!statuses[child].has_value()) {
+            int status = 0;
+            ::waitpid(children[child], &status, 0);
+            statuses[child] = status;
+        }
+        failed |= !succeeded(*statuses[child]);
+    }
+    SharedMemoryTransport::removeChannels(name);
+
+    if (failed) {
+        throw std::runtime_error(std::format("A rank of the distributed run on {} failed", name));
+    }
+#endif
+}
\ No newline at end of file
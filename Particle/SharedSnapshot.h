@@ -0,0 +1,351 @@
+#pragma once
+
+#include "Particle.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <format>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/*
+ * Live snapshots in a POSIX shared memory object, for viewers and analysis scripts on the same host.
+ *
+ * Layout: SnapshotHeader, then slotCount slots of slotSize bytes. A slot is a SnapshotSlotHeader followed by
+ * one array of capacity doubles per SnapshotField, every part aligned to 64 bytes.
+ * Snapshot n goes into slot n % slotCount, published counts the snapshots written so far.
+ *
+ * Every slot is guarded by a seqlock: its sequence is odd while the writer fills it. A reader takes the
+ * sequence, reads, and keeps what it read only if the sequence is still the same and even. The writer never waits.
+ */
+enum class SnapshotField {
+    X,
+    Y,
+    Z,
+    VelocityX,
+    VelocityY,
+    VelocityZ,
+    Mass,
+    Count
+};
+
+constexpr size_t snapshotFieldCount = static_cast<size_t>(SnapshotField::Count);
+
+struct SnapshotHeader {
+        static constexpr std::array<char, 8> expectedMagic{'P', 'A', 'R', 'T', 'S', 'H', 'M', '\0'};
+        static constexpr uint32_t currentVersion = 1;
+
+        std::array<char, 8> magic = expectedMagic;
+        uint32_t version = currentVersion;
+        uint32_t slotCount = 0;
+        uint64_t capacity = 0; // Particles per slot
+        uint64_t slotSize = 0; // Bytes
+        std::atomic<uint64_t> published{0};
+};
+
+struct SnapshotSlotHeader {
+        std::atomic<uint64_t> sequence{0};
+        uint64_t step = 0;
+        uint64_t particleCount = 0; // Stored, at most capacity
+        uint64_t totalCount = 0;    // Enabled particles in the simulation
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "Atomics in shared memory have to be lock free");
+
+namespace snapshot {
+    constexpr size_t alignment = 64;
+
+    constexpr size_t align(size_t size) {
+        return (size + alignment - 1) / alignment * alignment;
+    }
+
+    constexpr size_t headerSize() {
+        return align(sizeof(SnapshotHeader));
+    }
+
+    constexpr size_t fieldOffset(size_t capacity, size_t field) {
+        return align(sizeof(SnapshotSlotHeader)) + field * align(capacity * sizeof(double));
+    }
+
+    constexpr size_t slotSize(size_t capacity) {
+        return fieldOffset(capacity, snapshotFieldCount);
+    }
+}
+
+/*
+ * Creates the shared memory object and writes the snapshots. Only one publisher per name.
+ */
+class SnapshotPublisher {
+    public:
+        // The name starts with a slash, like "/particle". Throws std::runtime_error if the object can't be created
+        SnapshotPublisher(const std::string& name, uint32_t slotCount = 4, size_t capacity = 1 << 16) :
+                _name(name) {
+#ifdef _WIN32
+            throw std::runtime_error("Shared memory snapshots need POSIX shared memory");
+#else
+            const size_t slot = snapshot::slotSize(capacity);
+            _size = snapshot::headerSize() + slotCount * slot;
+
+            const int fd = ::shm_open(name.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0644);
+            if (fd < 0) {
+                throw std::runtime_error(std::format("Could not create shared memory {}", name));
+            }
+            const bool sized = ::ftruncate(fd, static_cast<off_t>(_size)) == 0;
+            void* data = sized ? ::mmap(nullptr, _size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+            ::close(fd);
+
+            if (data == MAP_FAILED) {
+                ::shm_unlink(name.c_str());
+                throw std::runtime_error(std::format("Could not map shared memory {}", name));
+            }
+            _data = static_cast<std::byte*>(data);
+
+            // The magic is written last, readers that see it see a complete layout
+            SnapshotHeader* header = new (_data) SnapshotHeader();
+            header->magic = {};
+            header->slotCount = slotCount;
+            header->capacity = capacity;
+            header->slotSize = slot;
+            for (uint32_t i = 0; i < slotCount; i++) {
+                new (_data + snapshot::headerSize() + i * slot) SnapshotSlotHeader();
+            }
+            std::atomic_thread_fence(std::memory_order_release);
+            header->magic = SnapshotHeader::expectedMagic;
+#endif
+        }
+
+        SnapshotPublisher(const SnapshotPublisher&) = delete;
+        SnapshotPublisher& operator=(const SnapshotPublisher&) = delete;
+
+        // Readers that are attached keep their mapping, new ones can't attach anymore
+        ~SnapshotPublisher() {
+#ifndef _WIN32
+            ::munmap(_data, _size);
+            ::shm_unlink(_name.c_str());
+#endif
+        }
+
+        // Disabled particles are skipped, particles beyond the capacity are cut off
+        void publish(std::span<const Particle> particles, uint64_t step) {
+            SnapshotHeader& head = header();
+            const uint64_t number = head.published.load(std::memory_order_relaxed);
+            std::byte* slot = _data + snapshot::headerSize() + (number % head.slotCount) * head.slotSize;
+            SnapshotSlotHeader& slotHeader = *reinterpret_cast<SnapshotSlotHeader*>(slot);
+
+            const uint64_t sequence = slotHeader.sequence.load(std::memory_order_relaxed);
+            slotHeader.sequence.store(sequence + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+
+            double* const x = field(slot, SnapshotField::X);
+            double* const y = field(slot, SnapshotField::Y);
+            double* const z = field(slot, SnapshotField::Z);
+            double* const vx = field(slot, SnapshotField::VelocityX);
+            double* const vy = field(slot, SnapshotField::VelocityY);
+            double* const vz = field(slot, SnapshotField::VelocityZ);
+            double* const mass = field(slot, SnapshotField::Mass);
+
+            uint64_t stored = 0;
+            uint64_t total = 0;
+            for (const Particle& p : particles) {
+                if (!p.isEnabled()) {
+                    continue;
+                }
+                total++;
+                if (stored == head.capacity) {
+                    continue;
+                }
+
+                x[stored] = p.position().x;
+                y[stored] = p.position().y;
+                z[stored] = p.position().z;
+                vx[stored] = p.velocity().x;
+                vy[stored] = p.velocity().y;
+                vz[stored] = p.velocity().z;
+                mass[stored] = p.mass();
+                stored++;
+            }
+            slotHeader.step = step;
+            slotHeader.particleCount = stored;
+            slotHeader.totalCount = total;
+
+            slotHeader.sequence.store(sequence + 2, std::memory_order_release);
+            head.published.store(number + 1, std::memory_order_release);
+        }
+
+        size_t capacity() const {
+            return reinterpret_cast<const SnapshotHeader*>(_data)->capacity;
+        }
+
+        const std::string& name() const {
+            return _name;
+        }
+
+    private:
+        std::string _name;
+        std::byte* _data = nullptr;
+        size_t _size = 0;
+
+        SnapshotHeader& header() {
+            return *reinterpret_cast<SnapshotHeader*>(_data);
+        }
+
+        double* field(std::byte* slot, SnapshotField field) {
+            return reinterpret_cast<double*>(slot + snapshot::fieldOffset(header().capacity, static_cast<size_t>(field)));
+        }
+};
+
+// Points straight into the shared memory, only trustworthy while SnapshotReader::isValid says so
+struct SnapshotView {
+        uint64_t step = 0;
+        uint64_t totalCount = 0;
+        std::array<std::span<const double>, snapshotFieldCount> fields;
+
+        std::span<const double> field(SnapshotField field) const {
+            return fields[static_cast<size_t>(field)];
+        }
+
+        const SnapshotSlotHeader* slot = nullptr;
+        uint64_t sequence = 0;
+};
+
+struct SnapshotCopy {
+        uint64_t step = 0;
+        uint64_t totalCount = 0;
+        std::array<std::vector<double>, snapshotFieldCount> fields;
+
+        const std::vector<double>& field(SnapshotField field) const {
+            return fields[static_cast<size_t>(field)];
+        }
+};
+
+/*
+ * Attaches read only to the snapshots of a publisher, possibly in another process.
+ */
+class SnapshotReader {
+    public:
+        // Throws std::runtime_error if there is no publisher with this name
+        explicit SnapshotReader(const std::string& name) {
+#ifdef _WIN32
+            throw std::runtime_error("Shared memory snapshots need POSIX shared memory");
+#else
+            const int fd = ::shm_open(name.c_str(), O_RDONLY, 0);
+            if (fd < 0) {
+                throw std::runtime_error(std::format("Could not open shared memory {}", name));
+            }
+
+            struct stat status;
+            if (::fstat(fd, &status) != 0) {
+                ::close(fd);
+                throw std::runtime_error(std::format("Could not stat shared memory {}", name));
+            }
+            _size = static_cast<size_t>(status.st_size);
+            void* data = (_size >= snapshot::headerSize()) ? ::mmap(nullptr, _size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+            ::close(fd);
+
+            if (data == MAP_FAILED) {
+                throw std::runtime_error(std::format("Could not map shared memory {}", name));
+            }
+            _data = static_cast<const std::byte*>(data);
+
+            const SnapshotHeader& head = header();
+            std::atomic_thread_fence(std::memory_order_acquire);
+            const bool valid = (head.magic == SnapshotHeader::expectedMagic) and (head.version == SnapshotHeader::currentVersion) and
+                               (head.slotCount > 0) and (head.slotSize == snapshot::slotSize(head.capacity)) and
+                               (_size >= snapshot::headerSize() + head.slotCount * head.slotSize);
+            if (!valid) {
+                ::munmap(const_cast<std::byte*>(_data), _size);
+                throw std::runtime_error(std::format("{} holds no particle snapshots", name));
+            }
+#endif
+        }
+
+        SnapshotReader(const SnapshotReader&) = delete;
+        SnapshotReader& operator=(const SnapshotReader&) = delete;
+
+        ~SnapshotReader() {
+#ifndef _WIN32
+            ::munmap(const_cast<std::byte*>(_data), _size);
+#endif
+        }
+
+        // Snapshots published so far, a change means there is a newer one
+        uint64_t published() const {
+            return header().published.load(std::memory_order_acquire);
+        }
+
+        // Zero copy view of the newest snapshot, empty if there is none or the writer is just overwriting it
+        std::optional<SnapshotView> latest() const {
+            const SnapshotHeader& head = header();
+            const uint64_t count = head.published.load(std::memory_order_acquire);
+            if (count == 0) {
+                return std::nullopt;
+            }
+
+            const std::byte* slot = _data + snapshot::headerSize() + ((count - 1) % head.slotCount) * head.slotSize;
+            const SnapshotSlotHeader& slotHeader = *reinterpret_cast<const SnapshotSlotHeader*>(slot);
+            const uint64_t sequence = slotHeader.sequence.load(std::memory_order_acquire);
+            if ((sequence % 2) == 1) {
+                return std::nullopt;
+            }
+
+            SnapshotView view;
+            view.slot = &slotHeader;
+            view.sequence = sequence;
+            view.step = slotHeader.step;
+            view.totalCount = slotHeader.totalCount;
+            const size_t particleCount = std::min<uint64_t>(slotHeader.particleCount, head.capacity);
+            for (size_t field = 0; field < view.fields.size(); field++) {
+                view.fields[field] = std::span(reinterpret_cast<const double*>(slot + snapshot::fieldOffset(head.capacity, field)), particleCount);
+            }
+            return view;
+        }
+
+        // False if the writer started overwriting the slot of the view, whatever was read from it since latest is torn
+        bool isValid(const SnapshotView& view) const {
+            std::atomic_thread_fence(std::memory_order_acquire);
+            return view.slot->sequence.load(std::memory_order_relaxed) == view.sequence;
+        }
+
+        // Copies the newest snapshot, false if no consistent copy could be made within the given attempts
+        bool copyLatest(SnapshotCopy& out, int attempts = 8) const {
+            for (int attempt = 0; attempt < attempts; attempt++) {
+                const std::optional<SnapshotView> view = latest();
+                if (!view.has_value()) {
+                    continue;
+                }
+
+                out.step = view->step;
+                out.totalCount = view->totalCount;
+                for (size_t field = 0; field < out.fields.size(); field++) {
+                    out.fields[field].resize(view->fields[field].size());
+                    std::memcpy(out.fields[field].data(), view->fields[field].data(), view->fields[field].size_bytes());
+                }
+
+                if (isValid(*view)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+    private:
+        const std::byte* _data = nullptr;
+        size_t _size = 0;
+
+        const SnapshotHeader& header() const {
+            return *reinterpret_cast<const SnapshotHeader*>(_data);
+        }
+};
\ No newline at end of file
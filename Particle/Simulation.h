@@ -1,111 +1,391 @@
 #pragma once
 
-#include "BarnesHut.h"
 #include "Camera.h"
+#include "FrameGovernor.h"
+#include "FrameProfiler.h"
 #include "Picture.h"
+#include "Replay.h"
+#include "SharedSnapshot.h"
+#include "Trajectory.h"
+#include "World.h"
 
-#include <execution>
+#include <chrono>
+#include <iostream>
+#include <stdexcept>
+
+enum class RenderMode {
+    Particles,    // Every particle on its own
+    Culled,       // Every visible particle, whole octree cells outside of the view are skipped
+    LevelOfDetail // Culled and cells smaller than a pixel are drawn as one
+};
 
 class Simulation {
     public:
         explicit Simulation(Vector2u windowSize) :
-                _barnesHut(Position(-windowSize.x * 4, -windowSize.x * 4, -windowSize.x * 4), Position(windowSize.x * 4, windowSize.x * 4, windowSize.x * 4)),
+                _world(windowSize.x * 4),
                 _window(sf::VideoMode(windowSize.x, windowSize.y), "Particle"),
                 _pic(Vector2u(windowSize.x, windowSize.y), Camera(Position(windowSize.x, windowSize.y, -600), Vector2d(0.0, 0.0), 90)) {
             _window.setPosition({200, 5});
+            if constexpr (PerfCounters::enabled) {
+                // Before the first parallel step, so the worker threads inherit the counters
+                if (_perfCounters.open()) {
+                    _profiler.setPerfCounters(&_perfCounters);
+                }
+            }
+            _world.setProfiler(&_profiler);
+            _pic.setProfiler(&_profiler);
+            _pic.setTargetFrameTime(std::chrono::milliseconds(33)); // ~30 FPS
         }
 
         void step_bruteForce() {
-            handleEvents();
+            {
+                const FrameProfiler::ScopedTimer timer(&_profiler, Phase::Events);
+                handleEvents();
+            }
 
-            _pic.reset();
+            _governor.setKnobs(false, false);
+            runFrame(
+                [this]() {
+                    const int substeps = _simPaused ? 0 : _governor.settings().substeps;
+                    for (int substep = 0; substep < substeps; substep++) {
+                        _world.step_bruteForce();
+                        publishSnapshot();
+                    }
+                    checkpointIfDue();
+                    recordTrajectory();
+                },
+                [this]() {
+                    _pic.setParticles(_world.particles());
+                });
 
-            if (!_simPaused) {
-                std::ranges::for_each(_particles, [this](Particle& p) {
-                    for (Particle& other : _particles) {
-                        if (&p == &other) {
-                            continue;
-                        }
+            display();
+        }
+
+        void step_barnesHut() {
+            {
+                const FrameProfiler::ScopedTimer timer(&_profiler, Phase::Events);
+                handleEvents();
+            }
 
-                        p.accelerate(other.position(), other.mass());
+            _governor.setKnobs(true, _renderMode == RenderMode::LevelOfDetail);
+            const QualitySettings& quality = _governor.settings();
+            _world.barnesHut().setInfluenceThreshold(quality.theta);
 
-                        if (math::distance(p.position(), other.position()) < (p.radius() + other.radius())) {
-                            p.collide(other);
+            runFrame(
+                [this, &quality]() {
+                    // The tree is needed for rendering, so it is kept up to date even while paused
+                    if (_simPaused) {
+                        _world.updateTree();
+                    } else {
+                        for (int substep = 0; substep < quality.substeps; substep++) {
+                            _world.step_barnesHut();
+                            publishSnapshot();
                         }
                     }
-                });
+                    checkpointIfDue();
+                    recordTrajectory();
 
-                std::ranges::for_each(_particles, [this](Particle& p) {
-                    p.step();
+                    if constexpr (TraversalCounters::enabled) {
+                        _traversalStats = TraversalCounters::collect();
+                        _world.barnesHut().collectStats(_traversalStats);
+                    }
+                },
+                [this, &quality]() {
+                    if (_renderMode == RenderMode::Culled) {
+                        _pic.setTree(_world.barnesHut(), 0.0);
+                    } else if (_renderMode == RenderMode::LevelOfDetail) {
+                        _pic.setTree(_world.barnesHut(), quality.lodPixelSize);
+                    } else {
+                        _pic.setParticles(_world.particles());
+                    }
                 });
+
+            display();
+        }
+
+        // Shows a recorded trajectory instead of simulating, openReplay has to be called first
+        void step_replay() {
+            {
+                const FrameProfiler::ScopedTimer timer(&_profiler, Phase::Events);
+                handleEvents();
             }
 
-            for (const Particle& p : _particles) {
-                _pic.setParticle(p);
+            _replay->setPaused(_simPaused);
+            const std::shared_ptr<const ReplayFrame> frame = _replay->update();
+
+            {
+                const FrameProfiler::ScopedTimer timer(&_profiler, Phase::Rasterization);
+                _replayParticles.clear();
+                for (size_t i = 0; i < frame->positions.size(); i++) {
+                    _replayParticles.emplace_back(frame->positions[i], Vector3d(0.0, 0.0, 0.0), Vector3d(0.0, 0.0, 0.0), frame->masses[i]);
+                }
+
+                _pic.reset();
+                _pic.setParticles(_replayParticles);
             }
 
-            _window.clear();
-            _pic.render(_window);
-            _window.display();
+            display();
         }
 
-        void step_barnesHut() {
-            handleEvents();
+        void placeParticle(const Position& pos, const Vector3d& acceleration) {
+            _world.placeParticle(pos, acceleration);
+        }
 
-            _pic.reset();
+        void placeParticle(const Particle& p) {
+            _world.placeParticle(p);
+        }
 
-            std::erase_if(_particles, [](const Particle& p) {
-                return !p.isEnabled();
-            });
+        void placeParticles(std::span<const Particle> particles) {
+            _world.placeParticles(particles);
+        }
 
-            _barnesHut.resetCalculation();
-            _barnesHut.insertParticles(_particles);
+        void reserve(size_t particleCount) {
+            _world.reserve(particleCount);
+        }
 
-            if (!_simPaused) {
-                std::for_each(std::execution::seq, _particles.begin(), _particles.end(), [this](Particle& p) {
-                    if (p.isEnabled()) {
-                        _barnesHut.calculateAcceleration(p);
-                    }
-                });
+        bool saveCheckpoint(const std::filesystem::path& path, CheckpointMode mode = CheckpointMode::Blocking) {
+            return _world.saveCheckpoint(path, mode);
+        }
 
-                std::for_each(std::execution::seq, _particles.begin(), _particles.end(), [](Particle& p) {
-                    p.step();
-                });
-            }
+        // Forked checkpoint every so many steps, 0 turns it off
+        void setCheckpointInterval(const std::filesystem::path& path, uint64_t steps) {
+            _checkpointPath = path;
+            _checkpointInterval = steps;
+        }
 
-            for (const Particle& p : _particles) {
-                if (p.isEnabled()) {
-                    _pic.setParticle(p);
-                }
+        void loadCheckpoint(const std::filesystem::path& path) {
+            _world.loadCheckpoint(path);
+        }
+
+        // Positions of every displayed frame, compressed to positionBits per axis
+        void startTrajectory(const std::filesystem::path& path, uint32_t positionBits = 21) {
+            stopTrajectory();
+            _trajectory = std::make_unique<TrajectoryWriter>(path, positionBits);
+        }
+
+        // Writes the frame index, the file is incomplete before. Throws std::runtime_error if the file could not be written completely
+        void stopTrajectory() {
+            if (_trajectory != nullptr) {
+                const std::unique_ptr<TrajectoryWriter> trajectory = std::move(_trajectory);
+                trajectory->close();
             }
+        }
 
-            _window.clear();
-            _pic.render(_window);
-            _window.display();
+        // Publishes every step to the shared memory object name for SnapshotReaders, capacity 0 makes room for twice the current particles
+        void startSnapshotExport(const std::string& name, uint32_t slotCount = 4, size_t capacity = 0) {
+            stopSnapshotExport();
+            if (capacity == 0) {
+                capacity = std::max<size_t>(1 << 16, _world.particles().size() * 2);
+            }
+            _snapshots = std::make_unique<SnapshotPublisher>(name, slotCount, capacity);
         }
 
-        void placeParticle(const Position& pos, const Vector3d& acceleration) {
-            _particles.emplace_back(pos, acceleration);
+        void stopSnapshotExport() {
+            _snapshots.reset();
         }
 
-        void placeParticle(const Particle& p) {
-            _particles.push_back(p);
+        // Throws std::runtime_error if the file is not a complete trajectory
+        void openReplay(const std::filesystem::path& path, double framesPerSecond = 60.0) {
+            _replay = std::make_unique<ReplayPlayer>(path, framesPerSecond);
         }
 
         void setText(const std::string& text) {
-            _pic.setText(text);
+            _text = text;
+            updateText();
+        }
+
+        /*
+         * Render resolution drops down to 25% while frames take longer, 0 renders at full resolution always.
+         * With the governor enabled, accuracy and physics steps per frame are adjusted to the same budget.
+         */
+        void setFrameBudget(std::chrono::duration<double, std::milli> frameTime) {
+            _pic.setTargetFrameTime(frameTime);
+            _governor.setTargetFrameTime(frameTime);
+        }
+
+        // One row per frame with the milliseconds spent in every phase
+        void writeProfile(const std::filesystem::path& csvPath) {
+            _profiler.openCsv(csvPath);
+        }
+
+        // Work of the last step_barnesHut, all zero unless built with PARTICLE_TRAVERSAL_STATS
+        const TraversalStats& getTraversalStats() const {
+            return _traversalStats;
+        }
+
+        // Chrome/Perfetto trace of all phases and parallel work, written on exit or when tracing is toggled off with T
+        void startTrace(const std::filesystem::path& path) {
+            _tracePath = path;
+            Tracer::setEnabled(true);
+        }
+
+        void enableGovernor(bool enabled) {
+            _governor.setEnabled(enabled);
+            updateText();
+        }
+
+        void setRenderMode(RenderMode mode) {
+            _renderMode = mode;
+        }
+
+        // Throws std::runtime_error if the video or the frames can't be written there
+        void startRecording(const std::filesystem::path& path, RecordingFormat format, Backpressure backpressure = Backpressure::DropFrame) {
+            stopRecording();
+            _recorder = std::make_unique<Recorder>(path, _pic.getSize(), format, backpressure);
+            _pic.setRecorder(_recorder.get());
+        }
+
+        void stopRecording() {
+            _pic.setRecorder(nullptr);
+            _recorder.reset();
+        }
+
+        bool isRecording() const {
+            return _recorder != nullptr;
         }
 
     private:
-        std::vector<Particle> _particles;
-        BarnesHut _barnesHut;
+        World _world;
 
         sf::RenderWindow _window;
         Picture _pic;
+        std::unique_ptr<Recorder> _recorder;
+        std::unique_ptr<TrajectoryWriter> _trajectory;
+        std::unique_ptr<SnapshotPublisher> _snapshots;
+        std::optional<uint64_t> _lastSnapshotStep;
+        std::unique_ptr<ReplayPlayer> _replay;
+        std::vector<Particle> _replayParticles;
 
         bool _inMouseMove = false;
         bool _inMouseRotation = false;
         bool _simPaused = false;
+        RenderMode _renderMode = RenderMode::Particles;
+
+        FrameGovernor _governor{std::chrono::milliseconds(33)};
+        PerfCounters _perfCounters;
+        FrameProfiler _profiler;
+        bool _showProfile = false;
+        TraversalStats _traversalStats;
+        std::filesystem::path _tracePath = "trace.json";
+        std::filesystem::path _checkpointPath = "checkpoint.bin";
+        uint64_t _checkpointInterval = 0;
+        uint64_t _lastCheckpointStep = 0;
+        std::string _text;
+
+        void recordTrajectory() {
+            if ((_trajectory != nullptr) and !_simPaused) {
+                _trajectory->addFrame(_world.particles(), _world.getSteps());
+            }
+        }
+
+        // Clearing the last frame doesn't depend on the physics, the two overlap on the thread pool before the new frame is rasterized
+        void runFrame(std::function<void()> physics, std::function<void()> rasterize) {
+            TaskGraph frame;
+            const TaskGraph::TaskId simulated = frame.add(std::move(physics));
+            const TaskGraph::TaskId cleared = frame.add([this]() {
+                _pic.reset();
+            });
+            frame.add(
+                [this, &rasterize]() {
+                    const FrameProfiler::ScopedTimer timer(&_profiler, Phase::Rasterization);
+                    rasterize();
+                },
+                {simulated, cleared});
+            frame.run();
+        }
+
+        // After every substep, readers see each simulated step and not only the displayed ones
+        void publishSnapshot() {
+            if ((_snapshots != nullptr) and (_lastSnapshotStep != _world.getSteps())) {
+                _snapshots->publish(_world.particles(), _world.getSteps());
+                _lastSnapshotStep = _world.getSteps();
+            }
+        }
+
+        void checkpointIfDue() {
+            if ((_checkpointInterval > 0) and (_world.getSteps() >= _lastCheckpointStep + _checkpointInterval)) {
+                if (_world.saveCheckpoint(_checkpointPath, CheckpointMode::Forked)) {
+                    _lastCheckpointStep = _world.getSteps();
+                }
+            }
+        }
+
+        void display() {
+            {
+                const FrameProfiler::ScopedTimer timer(&_profiler, Phase::Display);
+                _window.clear();
+            }
+
+            _pic.render(_window);
+
+            {
+                const FrameProfiler::ScopedTimer timer(&_profiler, Phase::Display);
+                _window.display();
+            }
+
+            using Milliseconds = std::chrono::duration<double, std::milli>;
+            double physicsTime = 0.0;
+            for (Phase phase : {Phase::EraseDisabled, Phase::TreeBuild, Phase::ForceWalk, Phase::Integration}) {
+                physicsTime += _profiler.current(phase);
+            }
+            double renderTime = 0.0;
+            for (Phase phase : {Phase::Rasterization, Phase::TextureUpload, Phase::Display}) {
+                renderTime += _profiler.current(phase);
+            }
+
+            _governor.update(Milliseconds(physicsTime), Milliseconds(renderTime));
+            _pic.adaptRenderScale(Milliseconds(_profiler.current(Phase::Events) + physicsTime + renderTime));
+            _profiler.finishFrame();
+            updateText();
+        }
+
+        void updateText() {
+            std::string text = _text;
+            if (_governor.isEnabled()) {
+                text += "\n" + _governor.toString();
+            }
+            if (_replay != nullptr) {
+                text += std::format("\nreplay frame {}/{} | {:.0f} frames/s", _replay->currentFrame() + 1, _replay->frameCount(), _replay->getRate());
+            }
+            if (_world.getForkedCheckpointState() == CheckpointState::Writing) {
+                text += "\nwriting checkpoint";
+            }
+            if (_showProfile) {
+                text += "\n" + _profiler.toString();
+                if constexpr (TraversalCounters::enabled) {
+                    text += "\n" + _traversalStats.toString();
+                }
+            }
+            _pic.setText(text);
+        }
+
+        void handleReplayKey(sf::Keyboard::Key key) {
+            switch (key) {
+                case sf::Keyboard::Left:
+                    _replay->seekRelative(-60);
+                    break;
+                case sf::Keyboard::Right:
+                    _replay->seekRelative(60);
+                    break;
+                case sf::Keyboard::Comma:
+                    _replay->seekRelative(-1);
+                    break;
+                case sf::Keyboard::Period:
+                    _replay->seekRelative(1);
+                    break;
+                case sf::Keyboard::Up:
+                    _replay->setRate(_replay->getRate() * 2);
+                    break;
+                case sf::Keyboard::Down:
+                    _replay->setRate(_replay->getRate() / 2);
+                    break;
+                case sf::Keyboard::V:
+                    _replay->setRate(-_replay->getRate());
+                    break;
+                default:
+                    break;
+            }
+        }
 
         void handleEvents() {
             static Vector2d oldMousePosition;
@@ -114,6 +394,17 @@ class Simulation {
             while (_window.pollEvent(ev)) {
                 switch (ev.type) {
                     case sf::Event::Closed:
+                        stopRecording();
+                        try {
+                            stopTrajectory();
+                        } catch (const std::runtime_error& error) {
+                            std::cerr << error.what() << "\n"; // The other files are still written
+                        }
+                        stopSnapshotExport();
+                        _profiler.closeCsv(); // exit skips the destructors, the buffered rows would be lost
+                        if (Tracer::isEnabled()) {
+                            Tracer::writeJson(_tracePath);
+                        }
                         _window.close();
                         std::exit(0);
                         return;
@@ -124,6 +415,59 @@ class Simulation {
                         if (ev.key.code == sf::Keyboard::BackSpace) {
                             _pic.camera.reset();
                         }
+                        if (ev.key.code == sf::Keyboard::L) {
+                            _renderMode = static_cast<RenderMode>((static_cast<int>(_renderMode) + 1) % 3);
+                        }
+                        if (ev.key.code == sf::Keyboard::Add) {
+                            _pic.setExposure(_pic.getExposure() * 1.25f);
+                        }
+                        if (ev.key.code == sf::Keyboard::Subtract) {
+                            _pic.setExposure(_pic.getExposure() / 1.25f);
+                        }
+                        if (ev.key.code == sf::Keyboard::T) {
+                            // Tracing stops with the key press that writes the trace
+                            if (Tracer::isEnabled()) {
+                                Tracer::setEnabled(false);
+                                Tracer::writeJson(_tracePath);
+                            } else {
+                                Tracer::setEnabled(true);
+                            }
+                        }
+                        if (_replay != nullptr) {
+                            // No world to save, and a new trajectory would truncate the file that is played
+                            handleReplayKey(ev.key.code);
+                        } else {
+                            if (ev.key.code == sf::Keyboard::J) {
+                                if (_trajectory != nullptr) {
+                                    stopTrajectory();
+                                } else {
+                                    startTrajectory("trajectory.ptraj");
+                                }
+                            }
+                            if (ev.key.code == sf::Keyboard::K) {
+                                saveCheckpoint(_checkpointPath, CheckpointMode::Forked);
+                            }
+                        }
+                        if (ev.key.code == sf::Keyboard::F) {
+                            _showProfile = !_showProfile;
+                        }
+                        if (ev.key.code == sf::Keyboard::G) {
+                            enableGovernor(!_governor.isEnabled());
+                        }
+                        if (ev.key.code == sf::Keyboard::O) {
+                            _pic.setTrailDecay((_pic.getTrailDecay() > 0.0f) ? 0.0f : 0.95f);
+                        }
+                        if (ev.key.code == sf::Keyboard::C) {
+                            const ToneCurve next = static_cast<ToneCurve>((static_cast<int>(_pic.getToneCurve()) + 1) % 3);
+                            _pic.setToneCurve(next);
+                        }
+                        if (ev.key.code == sf::Keyboard::R) {
+                            if (isRecording()) {
+                                stopRecording();
+                            } else {
+                                startRecording("recording.y4m", RecordingFormat::Y4M);
+                            }
+                        }
                         break;
                     case sf::Event::MouseButtonPressed:
                         if (ev.mouseButton.button == sf::Mouse::Right) {
@@ -0,0 +1,387 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+/*
+ * One set of threads for every parallel phase, with work stealing: every worker has its own deque of tasks,
+ * takes the newest one of its own and steals the oldest one of another worker once it ran dry.
+ * Threads outside of the pool share one more deque. Waiting threads help instead of blocking,
+ * so nested parallel loops still finish. In a forked child the global pool starts over without workers.
+ */
+class ThreadPool {
+        using Task = std::function<void()>;
+
+        struct alignas(64) WorkQueue {
+                std::mutex mutex;
+                std::deque<Task> tasks;
+                std::atomic<size_t> size{0};
+        };
+
+    public:
+        // The calling thread helps, so there is one worker less than hardware threads
+        static ThreadPool& global() {
+            static ThreadPool pool(std::max(1u, std::thread::hardware_concurrency()) - 1);
+#ifndef _WIN32
+            static const bool registered = (::pthread_atfork(nullptr, nullptr, []() {
+                global().restartInChild();
+            }) == 0);
+            (void)registered;
+#endif
+            return pool;
+        }
+
+        explicit ThreadPool(size_t workers) {
+            start(workers);
+        }
+
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+
+        ~ThreadPool() {
+            stop();
+        }
+
+        // Threads working on a parallel loop, the calling one included
+        size_t threadCount() const {
+            return _threads.size() + 1;
+        }
+
+        // Only while nothing runs on the pool
+        void setThreadCount(size_t threads) {
+            stop();
+            start(std::max<size_t>(1, threads) - 1);
+        }
+
+        /*
+         * Calls body(from, to) on disjoint ranges that cover [begin; end[ and returns once all are done.
+         * Lazy binary splitting: a range is halved only while the deque of its thread is empty, so ranges are only
+         * split when there is someone to steal them, and expensive parts of the range end up split finer than cheap ones.
+         * Grain is the smallest range, 0 picks one from the range and thread count.
+         */
+        template <typename Body>
+        void parallelForRange(size_t begin, size_t end, Body&& body, size_t grain = 0) {
+            if (begin >= end) {
+                return;
+            }
+            if (grain == 0) {
+                grain = std::max<size_t>(1, (end - begin) / (threadCount() * 64));
+            }
+            if ((threadCount() == 1) or ((end - begin) <= grain)) {
+                body(begin, end);
+                return;
+            }
+
+            Loop<Body> loop(body, grain, end - begin);
+            runRange(loop, begin, end);
+            helpUntil(loop.remaining);
+            if (loop.error != nullptr) {
+                std::rethrow_exception(loop.error);
+            }
+        }
+
+        // Calls function(index) for every index of [begin; end[
+        template <typename Function>
+        void parallelFor(size_t begin, size_t end, Function&& function, size_t grain = 0) {
+            parallelForRange(begin, end, [&function](size_t from, size_t to) {
+                for (size_t i = from; i < to; i++) {
+                    function(i);
+                }
+            }, grain);
+        }
+
+        // Queued on the deque of the calling thread, someone has to wait for it with helpUntil
+        void submit(Task task) {
+            WorkQueue& queue = *_queues[localQueue()];
+            {
+                std::lock_guard lock(queue.mutex);
+                queue.tasks.push_back(std::move(task));
+                queue.size.fetch_add(1, std::memory_order_relaxed);
+            }
+            {
+                std::lock_guard lock(_sleepMutex);
+                _epoch.fetch_add(1, std::memory_order_release);
+            }
+            _wake.notify_one();
+            if (_sleepingHelpers.load(std::memory_order_relaxed) != 0) {
+                _helpers.notify_all();
+            }
+        }
+
+        // Runs queued tasks until the counter reaches zero. Without tasks to help with it sleeps until one is submitted or done
+        void helpUntil(const std::atomic<size_t>& remaining) {
+            size_t idle = 0;
+            while (remaining.load(std::memory_order_acquire) != 0) {
+                const uint64_t epoch = _epoch.load(std::memory_order_acquire);
+                if (Task task = findTask(localQueue())) {
+                    runTask(task);
+                    idle = 0;
+                } else if (++idle < spinsBeforeSleep) {
+                    std::this_thread::yield();
+                } else {
+                    std::unique_lock lock(_sleepMutex);
+                    _sleepingHelpers.fetch_add(1, std::memory_order_seq_cst);
+                    _helpers.wait(lock, [this, &remaining, epoch]() {
+                        return (remaining.load(std::memory_order_seq_cst) == 0) or (_epoch.load(std::memory_order_relaxed) != epoch);
+                    });
+                    _sleepingHelpers.fetch_sub(1, std::memory_order_relaxed);
+                    idle = 0;
+                }
+            }
+        }
+
+    private:
+        template <typename Body>
+        struct Loop {
+                Body& body;
+                const size_t grain;
+                std::atomic<size_t> remaining;
+                std::mutex errorMutex;
+                std::exception_ptr error;
+
+                Loop(Body& body, size_t grain, size_t count) :
+                        body(body),
+                        grain(grain),
+                        remaining(count) {
+                }
+        };
+
+        static constexpr size_t spinsBeforeSleep = 64; // Failed searches for a task before a waiting thread sleeps
+
+        static inline thread_local const ThreadPool* t_pool = nullptr;
+        static inline thread_local size_t t_queue = 0;
+
+        std::vector<std::thread> _threads;
+        std::vector<std::unique_ptr<WorkQueue>> _queues; // One per worker, the last one for all other threads
+        std::mutex _sleepMutex;
+        std::condition_variable _wake;
+        std::condition_variable _helpers; // Threads in helpUntil, woken by submissions and finished tasks
+        std::atomic<size_t> _sleepingHelpers{0};
+        std::atomic<uint64_t> _epoch{0}; // Counts submissions, sleeping workers wake up when it changes
+        std::atomic<bool> _stopping{false};
+
+        void start(size_t workers) {
+            _stopping.store(false);
+            _queues.clear();
+            for (size_t i = 0; i <= workers; i++) {
+                _queues.push_back(std::make_unique<WorkQueue>());
+            }
+            for (size_t i = 0; i < workers; i++) {
+                _threads.emplace_back([this, i]() {
+                    work(i);
+                });
+            }
+        }
+
+        void stop() {
+            {
+                std::lock_guard lock(_sleepMutex);
+                _stopping.store(true);
+            }
+            _wake.notify_all();
+            for (std::thread& thread : _threads) {
+                thread.join();
+            }
+            _threads.clear();
+        }
+
+        /*
+         * Only the forking thread exists in a child, the workers are gone and may have left the locks held.
+         * Their threads are forgotten instead of joined and the locks are made anew, queued tasks belong to the parent.
+         */
+        void restartInChild() {
+            for (std::thread& thread : _threads) {
+                new (&thread) std::thread();
+            }
+            _threads.clear();
+            for (std::unique_ptr<WorkQueue>& queue : _queues) {
+                (void)queue.release();
+            }
+            _queues.clear();
+            _queues.push_back(std::make_unique<WorkQueue>());
+
+            new (&_sleepMutex) std::mutex();
+            new (&_wake) std::condition_variable();
+            new (&_helpers) std::condition_variable();
+            _sleepingHelpers.store(0);
+            _stopping.store(false);
+            t_pool = nullptr;
+        }
+
+        size_t localQueue() const {
+            return (t_pool == this) ? t_queue : _threads.size();
+        }
+
+        template <typename Body>
+        void runRange(Loop<Body>& loop, size_t from, size_t to) {
+            const size_t queue = localQueue();
+            while (from < to) {
+                if (((to - from) > loop.grain) and (_queues[queue]->size.load(std::memory_order_relaxed) == 0)) {
+                    const size_t middle = from + (to - from) / 2;
+                    submit([this, &loop, middle, to]() {
+                        runRange(loop, middle, to);
+                    });
+                    to = middle;
+                    continue;
+                }
+
+                const size_t chunkEnd = std::min(to, from + loop.grain);
+                try {
+                    loop.body(from, chunkEnd);
+                } catch (...) {
+                    std::lock_guard lock(loop.errorMutex);
+                    if (loop.error == nullptr) {
+                        loop.error = std::current_exception();
+                    }
+                }
+                // The loop may be gone right after the last decrement
+                const size_t done = chunkEnd - from;
+                from = chunkEnd;
+                loop.remaining.fetch_sub(done, std::memory_order_acq_rel);
+            }
+        }
+
+        // A finished task may be the last one a helper waits for. The fence pairs with the helper counting itself before checking its counter
+        void runTask(Task& task) {
+            task();
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (_sleepingHelpers.load(std::memory_order_relaxed) != 0) {
+                {
+                    std::lock_guard lock(_sleepMutex);
+                }
+                _helpers.notify_all();
+            }
+        }
+
+        // Newest task of the own deque, else the oldest one of another deque
+        Task findTask(size_t own) {
+            for (size_t offset = 0; offset < _queues.size(); offset++) {
+                WorkQueue& queue = *_queues[(own + offset) % _queues.size()];
+                if (queue.size.load(std::memory_order_relaxed) == 0) {
+                    continue;
+                }
+
+                std::lock_guard lock(queue.mutex);
+                if (queue.tasks.empty()) {
+                    continue;
+                }
+                Task task;
+                if (offset == 0) {
+                    task = std::move(queue.tasks.back());
+                    queue.tasks.pop_back();
+                } else {
+                    task = std::move(queue.tasks.front());
+                    queue.tasks.pop_front();
+                }
+                queue.size.fetch_sub(1, std::memory_order_relaxed);
+                return task;
+            }
+            return {};
+        }
+
+        void work(size_t index) {
+            t_pool = this;
+            t_queue = index;
+
+            while (!_stopping.load()) {
+                const uint64_t epoch = _epoch.load(std::memory_order_acquire);
+                if (Task task = findTask(index)) {
+                    runTask(task);
+                    continue;
+                }
+
+                std::unique_lock lock(_sleepMutex);
+                _wake.wait(lock, [this, epoch]() {
+                    return _stopping.load() or (_epoch.load(std::memory_order_relaxed) != epoch);
+                });
+            }
+        }
+};
+
+/*
+ * Tasks with dependencies, every task is started on the pool as soon as the ones it depends on are done.
+ * Independent phases overlap, like clearing the frame buffer while the physics runs.
+ */
+class TaskGraph {
+    public:
+        using TaskId = size_t;
+
+        // Dependencies must have been added before
+        TaskId add(std::function<void()> task, std::initializer_list<TaskId> dependencies = {}) {
+            const TaskId id = _tasks.size();
+            _tasks.emplace_back(std::move(task), std::vector<TaskId>(), dependencies.size());
+            for (TaskId dependency : dependencies) {
+                _tasks[dependency].successors.push_back(id);
+            }
+            return id;
+        }
+
+        // Returns once every task ran, the calling thread helps. Rethrows the first exception of a task
+        void run(ThreadPool& pool = ThreadPool::global()) {
+            _pending = std::make_unique<std::atomic<size_t>[]>(_tasks.size());
+            _remaining.store(_tasks.size(), std::memory_order_relaxed);
+            _error = nullptr;
+            for (TaskId id = 0; id < _tasks.size(); id++) {
+                _pending[id].store(_tasks[id].dependencies, std::memory_order_relaxed);
+            }
+
+            for (TaskId id = 0; id < _tasks.size(); id++) {
+                if (_tasks[id].dependencies == 0) {
+                    start(pool, id);
+                }
+            }
+            pool.helpUntil(_remaining);
+
+            if (_error != nullptr) {
+                std::rethrow_exception(_error);
+            }
+        }
+
+    private:
+        struct Task {
+                std::function<void()> function;
+                std::vector<TaskId> successors;
+                size_t dependencies;
+        };
+
+        std::vector<Task> _tasks;
+        std::unique_ptr<std::atomic<size_t>[]> _pending; // Dependencies that are not done yet, per task
+        std::atomic<size_t> _remaining{0};
+        std::mutex _errorMutex;
+        std::exception_ptr _error;
+
+        void start(ThreadPool& pool, TaskId id) {
+            pool.submit([this, &pool, id]() {
+                try {
+                    _tasks[id].function();
+                } catch (...) {
+                    std::lock_guard lock(_errorMutex);
+                    if (_error == nullptr) {
+                        _error = std::current_exception();
+                    }
+                }
+
+                for (TaskId successor : _tasks[id].successors) {
+                    if (_pending[successor].fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                        start(pool, successor);
+                    }
+                }
+                _remaining.fetch_sub(1, std::memory_order_acq_rel);
+            });
+        }
+};
\ No newline at end of file
@@ -0,0 +1,146 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+struct TraceEvent {
+        const char* name; // Must outlive the tracer, string literals only
+        uint64_t start;   // ns since the tracer started
+        uint64_t duration;
+};
+
+/*
+ * Records begin/end of phases and parallel work items per thread and writes them as a Chrome/Perfetto trace.
+ * Every thread writes into its own ring buffer without locks, only the first event of a thread registers the buffer.
+ * When a buffer is full the oldest events are overwritten.
+ */
+class Tracer {
+        using Clock = std::chrono::steady_clock;
+
+    public:
+        static constexpr size_t eventsPerThread = size_t(1) << 16;
+
+        // Records the lifetime of the scope if tracing is enabled at construction
+        class Scope {
+            public:
+                explicit Scope(const char* name) :
+                        _name(isEnabled() ? name : nullptr),
+                        _start(_name != nullptr ? now() : 0) {
+                }
+
+                Scope(const Scope&) = delete;
+                Scope& operator=(const Scope&) = delete;
+
+                ~Scope() {
+                    if (_name != nullptr) {
+                        localBuffer().push(TraceEvent(_name, _start, now() - _start));
+                    }
+                }
+
+            private:
+                const char* _name;
+                uint64_t _start;
+        };
+
+        static void setEnabled(bool enabled) {
+            state().enabled.store(enabled, std::memory_order_relaxed);
+        }
+
+        static bool isEnabled() {
+            return state().enabled.load(std::memory_order_relaxed);
+        }
+
+        // Writes everything recorded since the last call. Only complete events, threads may keep tracing meanwhile
+        static void writeJson(const std::filesystem::path& path) {
+            std::ofstream out(path);
+            out << "{\"traceEvents\":[\n";
+
+            bool first = true;
+            std::lock_guard lock(state().mutex);
+            for (const std::unique_ptr<ThreadBuffer>& buffer : state().buffers) {
+                // Like a seqlock: only events published before the acquire are complete. The owner may wrap around meanwhile
+                // and overwrite the oldest ones, those are copied anyway and dropped once the published index shows they were reused
+                const uint64_t written = buffer->written.load(std::memory_order_acquire);
+                const uint64_t from = std::max(buffer->flushed, (written > eventsPerThread) ? (written - eventsPerThread) : 0);
+                std::vector<TraceEvent> copied;
+                copied.reserve(written - from);
+                for (uint64_t i = from; i < written; i++) {
+                    copied.push_back(buffer->load(i % eventsPerThread));
+                }
+                std::atomic_thread_fence(std::memory_order_acquire);
+                const uint64_t writing = buffer->written.load(std::memory_order_relaxed); // Its slot is the one of writing - eventsPerThread
+                const uint64_t intact = (writing >= eventsPerThread) ? (writing - eventsPerThread + 1) : 0;
+
+                for (uint64_t i = std::max(from, intact); i < written; i++) {
+                    const TraceEvent& event = copied[i - from];
+                    out << (first ? "" : ",\n");
+                    out << std::format(R"({{"name":"{}","ph":"X","ts":{:.3f},"dur":{:.3f},"pid":1,"tid":{}}})", event.name, event.start / 1000.0, event.duration / 1000.0, buffer->threadId);
+                    first = false;
+                }
+
+                buffer->flushed = written;
+            }
+
+            out << "\n]}\n";
+        }
+
+    private:
+        struct ThreadBuffer {
+                std::unique_ptr<TraceEvent[]> events = std::make_unique<TraceEvent[]>(eventsPerThread);
+                std::atomic<uint64_t> written = 0;
+                uint32_t threadId = 0;
+                uint64_t flushed = 0; // Guarded by the mutex, only touched while writing the trace
+
+                // Only ever called by the owning thread. The fence orders the slot after the index that was published before,
+                // so a reader that sees part of the new event also sees that its slot was reused
+                void push(const TraceEvent& event) {
+                    const uint64_t index = written.load(std::memory_order_relaxed);
+                    std::atomic_thread_fence(std::memory_order_release);
+                    TraceEvent& slot = events[index % eventsPerThread];
+                    std::atomic_ref(slot.name).store(event.name, std::memory_order_relaxed);
+                    std::atomic_ref(slot.start).store(event.start, std::memory_order_relaxed);
+                    std::atomic_ref(slot.duration).store(event.duration, std::memory_order_relaxed);
+                    written.store(index + 1, std::memory_order_release);
+                }
+
+                // Any thread, the slot may be written at the same time
+                TraceEvent load(size_t slot) const {
+                    TraceEvent& event = events[slot];
+                    return TraceEvent(std::atomic_ref(event.name).load(std::memory_order_relaxed), std::atomic_ref(event.start).load(std::memory_order_relaxed),
+                        std::atomic_ref(event.duration).load(std::memory_order_relaxed));
+                }
+        };
+
+        struct State {
+                std::atomic<bool> enabled = false;
+                std::mutex mutex;
+                std::vector<std::unique_ptr<ThreadBuffer>> buffers; // Never shrinks, threads may end before the trace is written
+                Clock::time_point epoch = Clock::now();
+        };
+
+        static State& state() {
+            static State instance;
+            return instance;
+        }
+
+        static uint64_t now() {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - state().epoch).count();
+        }
+
+        static ThreadBuffer& localBuffer() {
+            thread_local ThreadBuffer* buffer = []() {
+                std::lock_guard lock(state().mutex);
+                std::unique_ptr<ThreadBuffer>& created = state().buffers.emplace_back(std::make_unique<ThreadBuffer>());
+                created->threadId = static_cast<uint32_t>(state().buffers.size());
+                return created.get();
+            }();
+            return *buffer;
+        }
+};
\ No newline at end of file
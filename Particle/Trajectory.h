@@ -0,0 +1,472 @@
+#pragma once
+
+#include "BoundedQueue.h"
+#include "MappedFile.h"
+#include "Particle.h"
+#include "Recorder.h"
+#include "Vector.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <span>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+struct TrajectoryFileHeader {
+        static constexpr std::array<char, 8> expectedMagic = {'P', 'A', 'R', 'T', 'T', 'R', 'A', 'J'};
+        static constexpr uint32_t currentVersion = 1;
+
+        std::array<char, 8> magic = expectedMagic;
+        uint32_t version = currentVersion;
+        uint32_t positionBits = 21; // Per axis
+};
+
+struct TrajectoryFrameHeader {
+        uint64_t step = 0;
+        uint32_t particleCount = 0;
+        uint32_t payloadSize = 0;     // Bytes following this header
+        uint32_t predictionOrder = 0; // 0 keyframe, 1 previous frame, 2 extrapolated from the two previous frames
+        uint32_t reserved = 0;
+        Position boxFrom;  // Quantization grid, fixed from one keyframe to the next
+        Vector3d cellSize;
+};
+
+struct TrajectoryIndexEntry {
+        uint64_t offset; // Of the frame header from the start of the file
+        uint64_t step;
+        uint64_t keyframe; // Frame that decoding has to start from to reach this one
+};
+
+// Last bytes of the file, the index table sits right before it
+struct TrajectoryTrailer {
+        uint64_t indexOffset = 0;
+        uint64_t frameCount = 0;
+        std::array<char, 8> magic = TrajectoryFileHeader::expectedMagic;
+};
+
+/*
+ * Positions are quantized to a grid over a bounding box with some room to move. Every frame stores the difference
+ * between the grid position and a prediction as zigzag varints: in keyframes the previous particle, afterwards the same
+ * particle one frame earlier, and from the second frame on its linear extrapolation, which is nearly exact for
+ * particles moving at constant speed. A keyframe starts over whenever particles are added, merged or leave the box.
+ * Encoding and decoding run the same prediction, so the decoder needs the same frames in the same order.
+ */
+class TrajectoryCodec {
+        using Quantized = std::array<int32_t, 3>;
+
+    public:
+        static constexpr uint32_t keyframeInterval = 64; // Bounds how far a seek has to decode
+
+        explicit TrajectoryCodec(uint32_t positionBits) :
+                _maxQuantized((int32_t(1) << std::clamp(positionBits, 8u, 21u)) - 1) {
+        }
+
+        TrajectoryFrameHeader encode(uint64_t step, std::span<const Position> positions, std::span<const float> masses, std::vector<uint8_t>& payload) {
+            const size_t count = positions.size();
+            bool keyframe = (_framesSinceKeyframe >= keyframeInterval) or (count != _previous.size()) or !std::ranges::equal(masses, _masses);
+            keyframe = keyframe or !quantize(positions);
+            if (keyframe) {
+                chooseBox(positions);
+                quantize(positions);
+                _masses.assign(masses.begin(), masses.end());
+            }
+
+            TrajectoryFrameHeader header;
+            header.step = step;
+            header.particleCount = static_cast<uint32_t>(count);
+            header.predictionOrder = keyframe ? 0 : ((_framesSinceKeyframe == 0) ? 1 : 2);
+            header.boxFrom = _boxFrom;
+            header.cellSize = _cellSize;
+
+            payload.clear();
+            if (keyframe) {
+                const uint8_t* massBytes = reinterpret_cast<const uint8_t*>(_masses.data());
+                payload.insert(payload.end(), massBytes, massBytes + _masses.size() * sizeof(float));
+            }
+            for (size_t i = 0; i < count; i++) {
+                const Quantized predicted = predict(header.predictionOrder, i);
+                for (size_t axis = 0; axis < 3; axis++) {
+                    putVarint(payload, zigzag(_current[i][axis] - predicted[axis]));
+                }
+            }
+            header.payloadSize = static_cast<uint32_t>(payload.size());
+
+            advance(keyframe);
+            return header;
+        }
+
+        // Throws std::runtime_error on a corrupt payload or a delta frame without its predecessors
+        void decode(const TrajectoryFrameHeader& header, std::span<const uint8_t> payload, std::vector<Position>& positions, std::vector<float>& masses) {
+            const size_t count = header.particleCount;
+            const bool keyframe = header.predictionOrder == 0;
+            const uint8_t* read = payload.data();
+            const uint8_t* end = read + payload.size();
+
+            if (keyframe) {
+                _boxFrom = header.boxFrom;
+                _cellSize = header.cellSize;
+                if (payload.size() < count * sizeof(float)) {
+                    throw std::runtime_error("Trajectory keyframe is truncated");
+                }
+                _masses.resize(count);
+                std::memcpy(_masses.data(), read, count * sizeof(float));
+                read += count * sizeof(float);
+            } else if ((count != _previous.size()) or ((header.predictionOrder == 2) and (count != _beforePrevious.size()))) {
+                throw std::runtime_error("Trajectory delta frame without the frames it depends on");
+            }
+
+            _current.resize(count);
+            for (size_t i = 0; i < count; i++) {
+                const Quantized predicted = predict(header.predictionOrder, i);
+                for (size_t axis = 0; axis < 3; axis++) {
+                    _current[i][axis] = predicted[axis] + unzigzag(getVarint(read, end));
+                }
+            }
+
+            positions.resize(count);
+            for (size_t i = 0; i < count; i++) {
+                positions[i] = Position(_boxFrom.x + _current[i][0] * _cellSize.x, _boxFrom.y + _current[i][1] * _cellSize.y, _boxFrom.z + _current[i][2] * _cellSize.z);
+            }
+            masses = _masses;
+
+            advance(keyframe);
+        }
+
+    private:
+        const int32_t _maxQuantized;
+
+        Position _boxFrom;
+        Vector3d _cellSize;
+        std::vector<float> _masses;
+        std::vector<Quantized> _current;
+        std::vector<Quantized> _previous;
+        std::vector<Quantized> _beforePrevious;
+        uint32_t _framesSinceKeyframe = keyframeInterval; // The first frame is always a keyframe
+
+        static uint32_t zigzag(int32_t value) {
+            return (static_cast<uint32_t>(value) << 1) ^ static_cast<uint32_t>(value >> 31);
+        }
+
+        static int32_t unzigzag(uint32_t value) {
+            return static_cast<int32_t>(value >> 1) ^ -static_cast<int32_t>(value & 1);
+        }
+
+        static void putVarint(std::vector<uint8_t>& out, uint32_t value) {
+            while (value >= 0x80) {
+                out.push_back(static_cast<uint8_t>(value | 0x80));
+                value >>= 7;
+            }
+            out.push_back(static_cast<uint8_t>(value));
+        }
+
+        static uint32_t getVarint(const uint8_t*& read, const uint8_t* end) {
+            uint32_t value = 0;
+            for (int shift = 0; shift < 35; shift += 7) {
+                if (read == end) {
+                    throw std::runtime_error("Trajectory frame is truncated");
+                }
+                const uint8_t byte = *read++;
+                value |= static_cast<uint32_t>(byte & 0x7f) << shift;
+                if ((byte & 0x80) == 0) {
+                    return value;
+                }
+            }
+            throw std::runtime_error("Trajectory frame has an invalid varint");
+        }
+
+        Quantized predict(uint32_t order, size_t i) const {
+            if (order == 0) {
+                return (i == 0) ? Quantized{0, 0, 0} : _current[i - 1];
+            }
+            if (order == 1) {
+                return _previous[i];
+            }
+            const Quantized& a = _previous[i];
+            const Quantized& b = _beforePrevious[i];
+            return {2 * a[0] - b[0], 2 * a[1] - b[1], 2 * a[2] - b[2]};
+        }
+
+        void advance(bool keyframe) {
+            _framesSinceKeyframe = keyframe ? 0 : (_framesSinceKeyframe + 1);
+            std::swap(_beforePrevious, _previous);
+            std::swap(_previous, _current);
+        }
+
+        void chooseBox(std::span<const Position> positions) {
+            Position from(0.0, 0.0, 0.0);
+            Position to(0.0, 0.0, 0.0);
+            if (!positions.empty()) {
+                from = to = positions.front();
+            }
+            for (const Position& p : positions) {
+                from = Position(std::min(from.x, p.x), std::min(from.y, p.y), std::min(from.z, p.z));
+                to = Position(std::max(to.x, p.x), std::max(to.y, p.y), std::max(to.z, p.z));
+            }
+
+            // A quarter of the extent in every direction, so particles don't leave the box right away
+            const Vector3d margin = (to - from) * 0.25 + Vector3d(1.0, 1.0, 1.0);
+            _boxFrom = from - margin;
+            _cellSize = ((to - from) + margin * 2.0) / static_cast<double>(_maxQuantized);
+        }
+
+        // False if a particle is outside of the box
+        bool quantize(std::span<const Position> positions) {
+            _current.resize(positions.size());
+            for (size_t i = 0; i < positions.size(); i++) {
+                const Vector3d cell = (positions[i] - _boxFrom) / _cellSize;
+                const std::array<double, 3> axes = {cell.x, cell.y, cell.z};
+                for (size_t axis = 0; axis < 3; axis++) {
+                    const double rounded = std::round(axes[axis]);
+                    if (!(rounded >= 0.0) or (rounded > _maxQuantized)) {
+                        return false;
+                    }
+                    _current[i][axis] = static_cast<int32_t>(rounded);
+                }
+            }
+            return true;
+        }
+};
+
+/*
+ * Streams compressed particle positions to a file. The simulation thread only copies positions and masses into a
+ * recycled frame, quantizing, encoding and writing happen on a background thread.
+ * The frame index is written by close or when the writer is destroyed, a file without it can't be seeked.
+ */
+class TrajectoryWriter {
+        struct Frame {
+                uint64_t step = 0;
+                std::vector<Position> positions;
+                std::vector<float> masses;
+        };
+
+    public:
+        // Throws std::runtime_error if the file can't be written
+        explicit TrajectoryWriter(const std::filesystem::path& path, uint32_t positionBits = 21, Backpressure backpressure = Backpressure::Block, size_t queueCapacity = 8) :
+                _path(path),
+                _file(path, std::ios::binary | std::ios::trunc),
+                _backpressure(backpressure),
+                _codec(positionBits),
+                _frames(queueCapacity),
+                _freeFrames(queueCapacity + 1) {
+            TrajectoryFileHeader header;
+            header.positionBits = std::clamp(positionBits, 8u, 21u);
+            write(&header, sizeof(header));
+            if (!_file) {
+                throw std::runtime_error(std::format("Can't write the trajectory {}", path.string()));
+            }
+
+            _encoder = std::thread([this]() {
+                encode();
+            });
+        }
+
+        TrajectoryWriter(const TrajectoryWriter&) = delete;
+        TrajectoryWriter& operator=(const TrajectoryWriter&) = delete;
+
+        // A failure can't be reported from here, close it first to learn about it
+        ~TrajectoryWriter() {
+            try {
+                close();
+            } catch (const std::runtime_error&) {
+            }
+        }
+
+        // Writes the queued frames and the index. Throws std::runtime_error if any of it didn't make it into the file
+        void close() {
+            if (_closed) {
+                return;
+            }
+            _closed = true;
+            _frames.close();
+            _encoder.join();
+
+            TrajectoryTrailer trailer;
+            trailer.indexOffset = _bytesWritten;
+            trailer.frameCount = _index.size();
+            write(_index.data(), _index.size() * sizeof(TrajectoryIndexEntry));
+            write(&trailer, sizeof(trailer));
+
+            // The stream stays failed after the first write that failed, also one of the encoder
+            _file.close();
+            if (_file.fail()) {
+                throw std::runtime_error(std::format("The trajectory {} could not be written completely", _path.string()));
+            }
+        }
+
+        // Merged particles are left out
+        void addFrame(std::span<const Particle> particles, uint64_t step) {
+            Frame frame = _freeFrames.tryPop().value_or(Frame());
+            frame.step = step;
+            frame.positions.clear();
+            frame.masses.clear();
+            for (const Particle& p : particles) {
+                if (p.isEnabled()) {
+                    frame.positions.push_back(p.position());
+                    frame.masses.push_back(static_cast<float>(p.mass()));
+                }
+            }
+
+            if (_backpressure == Backpressure::Block) {
+                _frames.push(std::move(frame));
+            } else if (!_frames.tryPush(frame)) {
+                _droppedFrames++;
+                _freeFrames.tryPush(frame);
+            }
+        }
+
+        size_t writtenFrames() const {
+            return _writtenFrames;
+        }
+
+        size_t droppedFrames() const {
+            return _droppedFrames;
+        }
+
+        uint64_t bytesWritten() const {
+            return _bytesWritten;
+        }
+
+    private:
+        const std::filesystem::path _path;
+        std::ofstream _file;
+        bool _closed = false;
+        const Backpressure _backpressure;
+        TrajectoryCodec _codec;
+        std::vector<TrajectoryIndexEntry> _index;
+        uint64_t _lastKeyframe = 0;
+
+        BoundedQueue<Frame> _frames;
+        BoundedQueue<Frame> _freeFrames;
+        std::atomic<size_t> _writtenFrames = 0;
+        std::atomic<size_t> _droppedFrames = 0;
+        std::atomic<uint64_t> _bytesWritten = 0;
+
+        std::vector<uint8_t> _payload;
+        std::thread _encoder;
+
+        void write(const void* data, size_t size) {
+            _file.write(static_cast<const char*>(data), size);
+            _bytesWritten += size;
+        }
+
+        void encode() {
+            while (std::optional<Frame> frame = _frames.pop()) {
+                const TrajectoryFrameHeader header = _codec.encode(frame->step, frame->positions, frame->masses, _payload);
+                if (header.predictionOrder == 0) {
+                    _lastKeyframe = _index.size();
+                }
+                _index.push_back(TrajectoryIndexEntry(_bytesWritten, header.step, _lastKeyframe));
+
+                write(&header, sizeof(header));
+                write(_payload.data(), _payload.size());
+
+                _writtenFrames++;
+                _freeFrames.tryPush(*frame);
+            }
+
+            _file.flush();
+        }
+};
+
+/*
+ * Random access to the frames of a trajectory file through its index, the file is mapped and never copied.
+ * Thread safe, every thread decodes with its own TrajectoryDecoder.
+ */
+class TrajectoryReader {
+    public:
+        // Throws std::runtime_error if the file is not a complete trajectory
+        explicit TrajectoryReader(const std::filesystem::path& path) :
+                _file(path) {
+            const size_t minimumSize = sizeof(TrajectoryFileHeader) + sizeof(TrajectoryTrailer);
+            if ((_file.size() < minimumSize) or (fileHeader().magic != TrajectoryFileHeader::expectedMagic) or (fileHeader().version != TrajectoryFileHeader::currentVersion)) {
+                throw std::runtime_error(std::format("{} is not a trajectory", path.string()));
+            }
+
+            std::memcpy(&_trailer, _file.data() + _file.size() - sizeof(TrajectoryTrailer), sizeof(TrajectoryTrailer));
+            const uint64_t indexEnd = _trailer.indexOffset + _trailer.frameCount * sizeof(TrajectoryIndexEntry);
+            if ((_trailer.magic != TrajectoryFileHeader::expectedMagic) or (indexEnd != _file.size() - sizeof(TrajectoryTrailer))) {
+                throw std::runtime_error(std::format("{} has no frame index, it was not closed properly", path.string()));
+            }
+        }
+
+        size_t frameCount() const {
+            return _trailer.frameCount;
+        }
+
+        uint32_t positionBits() const {
+            return fileHeader().positionBits;
+        }
+
+        // Copied out, the index follows payloads of any size and is not aligned. Throws std::runtime_error for a frame that doesn't exist
+        TrajectoryIndexEntry entry(size_t frame) const {
+            if (frame >= frameCount()) {
+                throw std::runtime_error(std::format("Trajectory has no frame {}", frame));
+            }
+
+            TrajectoryIndexEntry entry;
+            std::memcpy(&entry, _file.data() + _trailer.indexOffset + frame * sizeof(TrajectoryIndexEntry), sizeof(entry));
+            return entry;
+        }
+
+        TrajectoryFrameHeader frameHeader(size_t frame) const {
+            const uint64_t offset = entry(frame).offset;
+            if ((offset < sizeof(TrajectoryFileHeader)) or (offset + sizeof(TrajectoryFrameHeader) > _trailer.indexOffset)) {
+                throw std::runtime_error("Trajectory frame lies outside of the frames");
+            }
+
+            TrajectoryFrameHeader header;
+            std::memcpy(&header, _file.data() + offset, sizeof(header));
+            return header;
+        }
+
+        std::span<const uint8_t> payload(size_t frame, const TrajectoryFrameHeader& header) const {
+            const uint64_t offset = entry(frame).offset + sizeof(TrajectoryFrameHeader);
+            if (offset + header.payloadSize > _trailer.indexOffset) {
+                throw std::runtime_error("Trajectory frame reaches into the index");
+            }
+            return std::span(reinterpret_cast<const uint8_t*>(_file.data() + offset), header.payloadSize);
+        }
+
+    private:
+        MappedFile _file;
+        TrajectoryTrailer _trailer;
+
+        const TrajectoryFileHeader& fileHeader() const {
+            return *reinterpret_cast<const TrajectoryFileHeader*>(_file.data());
+        }
+};
+
+// Decodes any frame, the one following the last decoded frame costs a single frame, others start at their keyframe
+class TrajectoryDecoder {
+    public:
+        explicit TrajectoryDecoder(const TrajectoryReader& reader) :
+                _reader(reader),
+                _codec(reader.positionBits()) {
+        }
+
+        void decode(size_t frame, std::vector<Position>& positions, std::vector<float>& masses) {
+            const size_t keyframe = _reader.entry(frame).keyframe;
+            const bool continues = _hasDecoded and (_lastFrame < frame) and (_lastFrame >= keyframe);
+            for (size_t current = continues ? (_lastFrame + 1) : keyframe; current <= frame; current++) {
+                const TrajectoryFrameHeader header = _reader.frameHeader(current);
+                _hasDecoded = false; // Stays false if decoding throws
+                _codec.decode(header, _reader.payload(current, header), positions, masses);
+                _lastFrame = current;
+                _hasDecoded = true;
+            }
+        }
+
+    private:
+        const TrajectoryReader& _reader;
+        TrajectoryCodec _codec;
+        size_t _lastFrame = 0;
+        bool _hasDecoded = false;
+};
\ No newline at end of file
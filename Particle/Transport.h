@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <span>
+#include <type_traits>
+#include <vector>
+
+using Buffer = std::vector<std::byte>;
+
+/*
+ * Message passing between the processes (ranks) of a distributed run.
+ * Every call is collective: all ranks make the same calls in the same order, like MPI.
+ */
+class Transport {
+    public:
+        virtual ~Transport() = default;
+
+        virtual int rank() const = 0;
+        virtual int size() const = 0;
+
+        // outgoing[r] goes to rank r, the result holds at [r] what rank r sent to this one
+        virtual std::vector<Buffer> allToAll(std::vector<Buffer> outgoing) = 0;
+
+        // Every rank gets the buffers of all ranks
+        std::vector<Buffer> allGather(const Buffer& buffer) {
+            return allToAll(std::vector<Buffer>(size(), buffer));
+        }
+
+        void barrier() {
+            allToAll(std::vector<Buffer>(size()));
+        }
+};
+
+namespace message {
+    template <typename T>
+    void append(Buffer& buffer, std::span<const T> values) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        const size_t offset = buffer.size();
+        buffer.resize(offset + values.size_bytes());
+        std::memcpy(buffer.data() + offset, values.data(), values.size_bytes());
+    }
+
+    template <typename T>
+    void append(Buffer& buffer, const T& value) {
+        append(buffer, std::span<const T>(&value, 1));
+    }
+
+    // The whole buffer as an array of T
+    template <typename T>
+    std::vector<T> read(const Buffer& buffer) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        std::vector<T> values(buffer.size() / sizeof(T));
+        std::memcpy(values.data(), buffer.data(), values.size() * sizeof(T));
+        return values;
+    }
+}
\ No newline at end of file
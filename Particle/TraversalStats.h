@@ -0,0 +1,105 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <format>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Counting costs a thread local increment per visited node, so it is off unless the build asks for it
+#ifndef PARTICLE_TRAVERSAL_STATS
+#define PARTICLE_TRAVERSAL_STATS 0
+#endif
+
+struct TraversalStats {
+        static constexpr size_t maxDepth = 64;
+
+        uint64_t nodesVisited = 0;
+        uint64_t particleInteractions = 0; // Particle-particle
+        uint64_t nodeInteractions = 0;     // Particle-node, whole cell used as one
+        uint64_t collisions = 0;
+        uint64_t merges = 0;
+
+        // Filled from the tree, not from the traversal
+        std::array<uint64_t, maxDepth> leafDepthHistogram{};
+        size_t nodeCount = 0;
+        size_t nodeCapacity = 0;
+
+        TraversalStats& operator+=(const TraversalStats& other) {
+            nodesVisited += other.nodesVisited;
+            particleInteractions += other.particleInteractions;
+            nodeInteractions += other.nodeInteractions;
+            collisions += other.collisions;
+            merges += other.merges;
+            return *this;
+        }
+
+        size_t treeDepth() const {
+            for (size_t depth = maxDepth; depth > 0; depth--) {
+                if (leafDepthHistogram[depth - 1] != 0) {
+                    return depth - 1;
+                }
+            }
+            return 0;
+        }
+
+        std::string toString() const {
+            return std::format("visited {} | p-p {} | p-node {} | collisions {} | merges {} | nodes {}/{} | depth {}", nodesVisited, particleInteractions, nodeInteractions, collisions, merges,
+                nodeCount, nodeCapacity, treeDepth());
+        }
+};
+
+/*
+ * Every thread counts into its own TraversalStats without synchronization.
+ * collect() sums them up and starts over, it must only be called while no traversal is running.
+ */
+class TraversalCounters {
+    public:
+        static constexpr bool enabled = PARTICLE_TRAVERSAL_STATS;
+
+        static TraversalStats& local() {
+            thread_local Registration registration;
+            return registration.stats;
+        }
+
+        static TraversalStats collect() {
+            std::lock_guard lock(registry().mutex);
+            TraversalStats out = registry().finishedThreads;
+            registry().finishedThreads = TraversalStats();
+
+            for (TraversalStats* stats : registry().threads) {
+                out += *stats;
+                *stats = TraversalStats();
+            }
+            return out;
+        }
+
+    private:
+        struct Registry {
+                std::mutex mutex;
+                std::vector<TraversalStats*> threads;
+                TraversalStats finishedThreads; // Counts of threads that ended before the last collect
+        };
+
+        // Registers the stats of a thread while it lives
+        struct Registration {
+                TraversalStats stats;
+
+                Registration() {
+                    std::lock_guard lock(registry().mutex);
+                    registry().threads.push_back(&stats);
+                }
+
+                ~Registration() {
+                    std::lock_guard lock(registry().mutex);
+                    registry().finishedThreads += stats;
+                    std::erase(registry().threads, &stats);
+                }
+        };
+
+        static Registry& registry() {
+            static Registry instance;
+            return instance;
+        }
+};
\ No newline at end of file
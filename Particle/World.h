@@ -0,0 +1,234 @@
+#pragma once
+
+#include "BarnesHut.h"
+#include "Checkpoint.h"
+#include "ForkedCheckpoint.h"
+#include "FrameProfiler.h"
+#include "Particle.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <mutex>
+#include <span>
+#include <vector>
+
+enum class Execution {
+    Sequential,
+    Parallel
+};
+
+/*
+ * Calls function(p, collisions) for every particle. Sequentially collisions is null and the function resolves them right away,
+ * in parallel it collects them and they are resolved afterwards on this thread, in the order of the particles.
+ */
+template <typename Function>
+void forEachParticleColliding(std::vector<Particle>& particles, Execution execution, Function&& function) {
+    if (execution != Execution::Parallel) {
+        for (Particle& p : particles) {
+            function(p, nullptr);
+        }
+        return;
+    }
+
+    std::mutex mutex;
+    std::vector<Collision> collisions;
+    ThreadPool::global().parallelForRange(0, particles.size(), [&particles, &function, &mutex, &collisions](size_t from, size_t to) {
+        std::vector<Collision> found;
+        for (size_t i = from; i < to; i++) {
+            function(particles[i], &found);
+        }
+        if (!found.empty()) {
+            std::lock_guard lock(mutex);
+            collisions.insert(collisions.end(), found.begin(), found.end());
+        }
+    });
+
+    // Ranges finish in any order, the collisions of one particle stay in the order they were found
+    std::ranges::stable_sort(collisions, {}, &Collision::particle);
+    resolveCollisions(collisions);
+}
+
+/*
+ * The particles and the physics, without anything to display them.
+ * Shared by the interactive simulation and the headless benchmark.
+ */
+class World {
+    public:
+        // Particles outside of [-extent; extent[ on every axis are not part of the Barnes-Hut tree
+        explicit World(double extent) :
+                _barnesHut(Position(-extent, -extent, -extent), Position(extent, extent, extent)) {
+        }
+
+        void step_bruteForce() {
+            _steps++;
+            {
+                const FrameProfiler::ScopedTimer timer(_profiler, Phase::ForceWalk);
+                forEachParticleColliding(_particles, _execution, [this](Particle& p, std::vector<Collision>* collisions) {
+                    for (Particle& other : _particles) {
+                        if (&p == &other) {
+                            continue;
+                        }
+
+                        p.accelerate(other.position(), other.mass());
+
+                        if (math::distance(p.position(), other.position()) < (p.radius() + other.radius())) {
+                            if (collisions != nullptr) {
+                                collisions->emplace_back(&p, &other);
+                            } else {
+                                p.collide(other);
+                            }
+                        }
+                    }
+                });
+            }
+
+            integrate();
+        }
+
+        void step_barnesHut() {
+            _steps++;
+            buildTree();
+
+            {
+                const FrameProfiler::ScopedTimer timer(_profiler, Phase::ForceWalk);
+                forEachParticleColliding(_particles, _execution, [this](Particle& p, std::vector<Collision>* collisions) {
+                    if (p.isEnabled()) {
+                        _barnesHut.calculateAcceleration(p, collisions);
+                    }
+                });
+            }
+
+            integrate();
+        }
+
+        // Drops merged particles and rebuilds the tree without moving anything
+        void buildTree() {
+            {
+                const FrameProfiler::ScopedTimer timer(_profiler, Phase::EraseDisabled);
+                std::erase_if(_particles, [](const Particle& p) {
+                    return !p.isEnabled();
+                });
+            }
+
+            const FrameProfiler::ScopedTimer timer(_profiler, Phase::TreeBuild);
+            _barnesHut.resetCalculation();
+            _barnesHut.insertParticles(_particles);
+            _treeCurrent = true;
+        }
+
+        // Only rebuilds if particles moved or were dropped since the last build
+        void updateTree() {
+            if (!_treeCurrent) {
+                buildTree();
+            }
+        }
+
+        void placeParticle(const Position& pos, const Vector3d& acceleration) {
+            placeParticle(Particle(pos, acceleration));
+        }
+
+        void placeParticle(const Particle& p) {
+            placeParticles(std::span(&p, 1));
+        }
+
+        // Grows the storage geometrically. While the particles don't move, a current tree takes the new ones in without a rebuild
+        void placeParticles(std::span<const Particle> particles) {
+            reserve(_particles.size() + particles.size());
+
+            const size_t first = _particles.size();
+            _particles.insert(_particles.end(), particles.begin(), particles.end());
+            if (_treeCurrent) {
+                _barnesHut.insertParticles(std::span(_particles).subspan(first));
+            }
+        }
+
+        // The tree points into the particles, moving them to a larger allocation outdates it
+        void reserve(size_t particleCount) {
+            if (particleCount > _particles.capacity()) {
+                _particles.reserve(std::max(particleCount, _particles.capacity() * 2));
+                _treeCurrent = false;
+            }
+        }
+
+        // Must be called between steps. A forked checkpoint is skipped (false) while the previous one is still written
+        bool saveCheckpoint(const std::filesystem::path& path, CheckpointMode mode = CheckpointMode::Blocking) {
+            if (mode == CheckpointMode::Forked) {
+                return _forkedCheckpoint.start(path, _particles, _steps);
+            }
+
+            Checkpoint::write(path, _particles, _steps);
+            return true;
+        }
+
+        CheckpointState getForkedCheckpointState() {
+            return _forkedCheckpoint.state();
+        }
+
+        // Replaces all particles, throws std::runtime_error if the file is not a valid checkpoint
+        void loadCheckpoint(const std::filesystem::path& path) {
+            const Checkpoint checkpoint(path);
+            checkpoint.restore(_particles);
+            _steps = checkpoint.step();
+            _treeCurrent = false;
+        }
+
+        uint64_t getSteps() const {
+            return _steps;
+        }
+
+        std::vector<Particle>& particles() {
+            return _particles;
+        }
+
+        const std::vector<Particle>& particles() const {
+            return _particles;
+        }
+
+        BarnesHut& barnesHut() {
+            return _barnesHut;
+        }
+
+        const BarnesHut& barnesHut() const {
+            return _barnesHut;
+        }
+
+        void setExecution(Execution execution) {
+            _execution = execution;
+        }
+
+        Execution getExecution() const {
+            return _execution;
+        }
+
+        void setProfiler(FrameProfiler* profiler) {
+            _profiler = profiler;
+        }
+
+    private:
+        std::vector<Particle> _particles;
+        BarnesHut _barnesHut;
+        Execution _execution = Execution::Sequential;
+        uint64_t _steps = 0;
+        bool _treeCurrent = false;
+        ForkedCheckpoint _forkedCheckpoint;
+        FrameProfiler* _profiler = nullptr;
+
+        void integrate() {
+            const FrameProfiler::ScopedTimer timer(_profiler, Phase::Integration);
+            forEachParticle([](Particle& p) {
+                p.step();
+            });
+            _treeCurrent = false;
+        }
+
+        template <typename Function>
+        void forEachParticle(Function&& function) {
+            if (_execution == Execution::Parallel) {
+                ThreadPool::global().parallelFor(0, _particles.size(), [this, &function](size_t i) {
+                    function(_particles[i]);
+                });
+            } else {
+                std::for_each(_particles.begin(), _particles.end(), function);
+            }
+        }
+};
\ No newline at end of file
@@ -0,0 +1,433 @@
+﻿// bench.cpp : Headless benchmark of the physics, sweeps over a matrix of scenarios and writes the results as JSON.
+//
+// particle_bench [--particles=1000,10000] [--distributions=ball,disk,plummer,hernquist,exponential-disk,soneira-peebles]
+//                [--engines=barnes-hut,brute-force] [--ranks=1,4] [--threads=1,2,4,8]
+//                [--execution=seq,par] [--theta=0.5] [--precision=fast,exact] [--warmup=3] [--steps=20] [--out=bench.json]
+
+#include "Distributed.h"
+#include "FrameProfiler.h"
+#include "Generators.h"
+#include "PerfCounters.h"
+#include "SharedMemoryTransport.h"
+#include "World.h"
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <chrono>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <print>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+enum class Engine {
+    BruteForce,
+    BarnesHut
+};
+
+struct Scenario {
+        size_t particleCount;
+        Model distribution;
+        Engine engine;
+        Execution execution;
+        double theta;
+        bool exactInfluence;
+        int ranks;      // Processes of a distributed run, 1 runs in this process
+        size_t threads; // Of the thread pool for parallel execution
+};
+
+struct BenchmarkOptions {
+        std::vector<size_t> particleCounts{1'000, 10'000};
+        std::vector<Model> distributions{Model::UniformBall, Model::UniformDisk};
+        std::vector<Engine> engines{Engine::BarnesHut, Engine::BruteForce};
+        std::vector<Execution> executions{Execution::Sequential, Execution::Parallel};
+        std::vector<double> thetas{0.5};
+        std::vector<bool> exactInfluences{false, true};
+        std::vector<int> rankCounts{1};
+        std::vector<size_t> threadCounts{ThreadPool::global().threadCount()};
+        int warmupSteps = 3;
+        int measuredSteps = 20;
+        std::string out = "bench.json";
+};
+
+struct StepTimes {
+        uint64_t min = 0; // ns
+        uint64_t median = 0;
+        uint64_t mean = 0;
+        uint64_t p99 = 0;
+        uint64_t max = 0;
+        uint64_t total = 0;
+};
+
+constexpr double spawnRadius = 500.0;
+constexpr double worldExtent = 4'000.0;
+constexpr uint64_t seed = 42;
+
+constexpr std::array<std::pair<Model, std::string_view>, 6> modelNames{{
+    {Model::UniformBall, "ball"},
+    {Model::UniformDisk, "disk"},
+    {Model::Plummer, "plummer"},
+    {Model::Hernquist, "hernquist"},
+    {Model::ExponentialDisk, "exponential-disk"},
+    {Model::SoneiraPeebles, "soneira-peebles"},
+}};
+
+std::string_view toString(Model model) {
+    return std::ranges::find(modelNames, model, &std::pair<Model, std::string_view>::first)->second;
+}
+
+std::string_view toString(Engine engine) {
+    return (engine == Engine::BarnesHut) ? "barnes-hut" : "brute-force";
+}
+
+std::string_view toString(Execution execution) {
+    return (execution == Execution::Parallel) ? "par" : "seq";
+}
+
+// Same seed for every scenario, so engines and settings are compared on identical initial conditions
+InitialConditions initialConditions(size_t particleCount, Model model) {
+    GeneratorSettings settings{.model = model, .seed = seed, .radius = spawnRadius};
+    if (model == Model::UniformDisk) {
+        settings.thickness = spawnRadius / 10.0;
+    } else if (model == Model::ExponentialDisk) {
+        settings.radius = spawnRadius / 4.0;
+        settings.thickness = spawnRadius / 40.0;
+    } else if ((model == Model::Plummer) or (model == Model::Hernquist)) {
+        settings.radius = spawnRadius / 4.0;
+    }
+
+    return Generator(settings).generate(particleCount);
+}
+
+StepTimes summarize(std::vector<uint64_t> durations) {
+    std::ranges::sort(durations);
+
+    StepTimes times;
+    for (uint64_t duration : durations) {
+        times.total += duration;
+    }
+    times.min = durations.front();
+    times.median = durations[durations.size() / 2];
+    times.mean = times.total / durations.size();
+    times.p99 = durations[(durations.size() * 99) / 100];
+    times.max = durations.back();
+    return times;
+}
+
+std::string describe(const Scenario& scenario, size_t threads) {
+    const bool barnesHut = scenario.engine == Engine::BarnesHut;
+    return std::format(R"("particles":{},"distribution":"{}","engine":"{}","execution":"{}","threads":{},"ranks":{},"theta":{},"precision":{},)", scenario.particleCount,
+        toString(scenario.distribution), toString(scenario.engine), toString(scenario.execution), threads, scenario.ranks,
+        barnesHut ? std::format("{}", scenario.theta) : "null", barnesHut ? (scenario.exactInfluence ? R"("exact")" : R"("fast")") : "null");
+}
+
+std::string describe(const StepTimes& times) {
+    return std::format(R"("stepNs":{{"min":{},"median":{},"mean":{},"p99":{},"max":{},"total":{}}})", times.min, times.median, times.mean, times.p99, times.max, times.total);
+}
+
+// Barnes-Hut split across forked processes, every rank runs sequentially on one thread. Rank 0 times the steps, they are collective
+std::string runDistributed(const Scenario& scenario, const BenchmarkOptions& options) {
+    // Generated before the fork, the children can't use the thread pool of this process
+    const InitialConditions initial = initialConditions(scenario.particleCount, scenario.distribution);
+
+    std::string json;
+    runOnSharedMemory(scenario.ranks, [&](Transport& transport) {
+        DistributedWorld world(transport, worldExtent);
+        world.barnesHut().setInfluenceThreshold(scenario.theta);
+        world.barnesHut().setExactInfluence(scenario.exactInfluence);
+        for (size_t i = transport.rank(); i < initial.size(); i += transport.size()) {
+            world.placeParticle(Particle(initial.position(i), Vector3d(0.0, 0.0, 0.0)));
+        }
+
+        for (int i = 0; i < options.warmupSteps; i++) {
+            world.step();
+        }
+
+        std::vector<uint64_t> durations;
+        durations.reserve(options.measuredSteps);
+        for (int i = 0; i < options.measuredSteps; i++) {
+            const auto startTime = std::chrono::steady_clock::now();
+            world.step();
+            const auto endTime = std::chrono::steady_clock::now();
+            durations.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(endTime - startTime).count());
+        }
+
+        const size_t remaining = world.totalParticles();
+        const double imbalance = world.costImbalance();
+        if (transport.rank() == 0) {
+            json = std::format(R"({{{}"remainingParticles":{},{},"costImbalance":{}}})", describe(scenario, 1), remaining, describe(summarize(std::move(durations))),
+                imbalance);
+        }
+    });
+    return json;
+}
+
+// Opened once before the first scenario, the workers of every scenario start later and are counted too
+PerfCounters& perfCounters() {
+    static PerfCounters counters;
+    return counters;
+}
+
+// Events per measured step of the phases of a step, from the profiler that was attached to the world
+std::string describeCounters(const FrameProfiler& profiler) {
+    std::string json;
+    for (Phase phase : {Phase::TreeBuild, Phase::ForceWalk, Phase::Integration}) {
+        const CounterValues mean = profiler.counterMean(phase);
+        std::string counters;
+        for (size_t counter = 0; counter < mean.size(); counter++) {
+            counters += std::format(R"({}"{}":{})", (counter == 0) ? "" : ",", counterNames[counter], mean[counter]);
+        }
+        json += std::format(R"({}"{}":{{{}}})", json.empty() ? "" : ",", phaseNames[static_cast<size_t>(phase)], counters);
+    }
+    return json;
+}
+
+std::string run(const Scenario& scenario, const BenchmarkOptions& options) {
+    if (scenario.ranks > 1) {
+        return runDistributed(scenario, options);
+    }
+
+    ThreadPool::global().setThreadCount(scenario.threads);
+    World world(worldExtent);
+    world.setExecution(scenario.execution);
+    world.barnesHut().setInfluenceThreshold(scenario.theta);
+    world.barnesHut().setExactInfluence(scenario.exactInfluence);
+    const InitialConditions initial = initialConditions(scenario.particleCount, scenario.distribution);
+    for (size_t i = 0; i < initial.size(); i++) {
+        world.placeParticle(initial.position(i), Vector3d(0.0, 0.0, 0.0));
+    }
+
+    auto step = [&world, &scenario]() {
+        if (scenario.engine == Engine::BarnesHut) {
+            world.step_barnesHut();
+        } else {
+            world.step_bruteForce();
+        }
+    };
+
+    for (int i = 0; i < options.warmupSteps; i++) {
+        step();
+    }
+    if constexpr (TraversalCounters::enabled) {
+        TraversalCounters::collect();
+    }
+
+    // Only the measured steps, one profiler frame per step
+    FrameProfiler profiler;
+    const bool withCounters = PerfCounters::enabled and perfCounters().isOpen();
+    if (withCounters) {
+        profiler.setPerfCounters(&perfCounters());
+        world.setProfiler(&profiler);
+    }
+
+    std::vector<uint64_t> durations;
+    durations.reserve(options.measuredSteps);
+    for (int i = 0; i < options.measuredSteps; i++) {
+        const auto startTime = std::chrono::steady_clock::now();
+        step();
+        const auto endTime = std::chrono::steady_clock::now();
+        durations.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(endTime - startTime).count());
+        profiler.finishFrame();
+    }
+    world.setProfiler(nullptr);
+
+    std::string json = std::format(R"({{{}"remainingParticles":{},{})", describe(scenario, scenario.threads), world.particles().size(), describe(summarize(std::move(durations))));
+    if (withCounters) {
+        json += std::format(R"(,"countersPerStep":{{{}}})", describeCounters(profiler));
+    }
+
+    if constexpr (TraversalCounters::enabled) {
+        const TraversalStats stats = TraversalCounters::collect();
+        json += std::format(R"(,"perStep":{{"nodesVisited":{},"particleInteractions":{},"nodeInteractions":{},"collisions":{}}})", stats.nodesVisited / options.measuredSteps,
+            stats.particleInteractions / options.measuredSteps, stats.nodeInteractions / options.measuredSteps, stats.collisions / options.measuredSteps);
+    }
+    return json + "}";
+}
+
+// The whole text has to be the number, anything else is no number
+template <typename T>
+std::optional<T> parseNumber(std::string_view text) {
+    T value{};
+    const auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+    if ((error != std::errc()) or (end != text.data() + text.size())) {
+        return std::nullopt;
+    }
+    return value;
+}
+
+// Nothing if the list is empty or any of its elements can't be parsed
+template <typename T, typename Parse>
+std::optional<std::vector<T>> parseList(std::string_view list, Parse&& parse) {
+    std::vector<T> values;
+    while (!list.empty()) {
+        const size_t comma = std::min(list.find(','), list.size());
+        const std::optional<T> value = parse(list.substr(0, comma));
+        if (!value) {
+            return std::nullopt;
+        }
+        values.push_back(*value);
+        list.remove_prefix(std::min(comma + 1, list.size()));
+    }
+    if (values.empty()) {
+        return std::nullopt;
+    }
+    return values;
+}
+
+template <typename T>
+bool assign(std::optional<T>&& parsed, T& option) {
+    if (!parsed) {
+        return false;
+    }
+    option = std::move(*parsed);
+    return true;
+}
+
+// Unknown names or values are rejected instead of falling back to a default, the results would be labeled with the fallback
+bool parseArguments(int argc, char** argv, BenchmarkOptions& options) {
+    for (int i = 1; i < argc; i++) {
+        const std::string_view argument = argv[i];
+        const size_t equals = argument.find('=');
+        if (!argument.starts_with("--") or (equals == std::string_view::npos)) {
+            return false;
+        }
+
+        const std::string_view name = argument.substr(2, equals - 2);
+        const std::string_view value = argument.substr(equals + 1);
+
+        bool parsed = false;
+        if (name == "particles") {
+            parsed = assign(parseList<size_t>(value, [](std::string_view count) {
+                return parseNumber<size_t>(count);
+            }), options.particleCounts);
+        } else if (name == "distributions") {
+            parsed = assign(parseList<Model>(value, [](std::string_view distribution) -> std::optional<Model> {
+                const auto found = std::ranges::find(modelNames, distribution, &std::pair<Model, std::string_view>::second);
+                if (found == modelNames.end()) {
+                    return std::nullopt;
+                }
+                return found->first;
+            }), options.distributions);
+        } else if (name == "engines") {
+            parsed = assign(parseList<Engine>(value, [](std::string_view engine) -> std::optional<Engine> {
+                if (engine == "brute-force") {
+                    return Engine::BruteForce;
+                }
+                if (engine == "barnes-hut") {
+                    return Engine::BarnesHut;
+                }
+                return std::nullopt;
+            }), options.engines);
+        } else if (name == "execution") {
+            parsed = assign(parseList<Execution>(value, [](std::string_view execution) -> std::optional<Execution> {
+                if (execution == "seq") {
+                    return Execution::Sequential;
+                }
+                if (execution == "par") {
+                    return Execution::Parallel;
+                }
+                return std::nullopt;
+            }), options.executions);
+        } else if (name == "theta") {
+            parsed = assign(parseList<double>(value, [](std::string_view theta) {
+                return parseNumber<double>(theta);
+            }), options.thetas);
+        } else if (name == "precision") {
+            parsed = assign(parseList<bool>(value, [](std::string_view precision) -> std::optional<bool> {
+                if ((precision != "fast") and (precision != "exact")) {
+                    return std::nullopt;
+                }
+                return precision == "exact";
+            }), options.exactInfluences);
+        } else if (name == "ranks") {
+            parsed = assign(parseList<int>(value, [](std::string_view ranks) {
+                return parseNumber<int>(ranks).transform([](int count) {
+                    return std::max(1, count);
+                });
+            }), options.rankCounts);
+        } else if (name == "threads") {
+            parsed = assign(parseList<size_t>(value, [](std::string_view threads) {
+                return parseNumber<size_t>(threads).transform([](size_t count) {
+                    return std::max<size_t>(1, count);
+                });
+            }), options.threadCounts);
+        } else if (name == "warmup") {
+            parsed = assign(parseNumber<int>(value).transform([](int steps) {
+                return std::max(0, steps);
+            }), options.warmupSteps);
+        } else if (name == "steps") {
+            parsed = assign(parseNumber<int>(value).transform([](int steps) {
+                return std::max(1, steps);
+            }), options.measuredSteps);
+        } else if (name == "out") {
+            options.out = std::string(value);
+            parsed = !value.empty();
+        }
+
+        if (!parsed) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    BenchmarkOptions options;
+    if (!parseArguments(argc, argv, options)) {
+        std::cerr << "usage: particle_bench [--particles=1000,10000] [--distributions=ball,disk,plummer,hernquist,exponential-disk,soneira-peebles]\n"
+                     "                      [--engines=barnes-hut,brute-force] [--execution=seq,par] [--ranks=1,4] [--threads=1,2,4,8]\n"
+                     "                      [--theta=0.5] [--precision=fast,exact] [--warmup=3] [--steps=20] [--out=bench.json]\n";
+        return 1;
+    }
+
+    std::vector<Scenario> scenarios;
+    for (size_t particleCount : options.particleCounts) {
+        for (Model distribution : options.distributions) {
+            for (Engine engine : options.engines) {
+                for (Execution execution : options.executions) {
+                    // Theta and precision only matter for Barnes-Hut, ranks only for sequential Barnes-Hut, threads only for parallel execution
+                    const size_t thetas = (engine == Engine::BarnesHut) ? options.thetas.size() : 1;
+                    const size_t precisions = (engine == Engine::BarnesHut) ? options.exactInfluences.size() : 1;
+                    const bool distributed = (engine == Engine::BarnesHut) and (execution == Execution::Sequential);
+                    const std::vector<int> rankCounts = distributed ? options.rankCounts : std::vector<int>{1};
+                    const std::vector<size_t> threadCounts = (execution == Execution::Parallel) ? options.threadCounts : std::vector<size_t>{1};
+
+                    for (size_t theta = 0; theta < thetas; theta++) {
+                        for (size_t precision = 0; precision < precisions; precision++) {
+                            for (int ranks : rankCounts) {
+                                for (size_t threads : threadCounts) {
+                                    scenarios.emplace_back(particleCount, distribution, engine, execution, options.thetas[theta], options.exactInfluences[precision], ranks,
+                                        threads);
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    if constexpr (PerfCounters::enabled) {
+        perfCounters().open();
+    }
+
+    std::ofstream out(options.out);
+    out << std::format(R"({{"warmupSteps":{},"measuredSteps":{},"hardwareThreads":{},"traversalStats":{},"perfCounters":{},"results":[)", options.warmupSteps,
+        options.measuredSteps, std::thread::hardware_concurrency(), TraversalCounters::enabled, perfCounters().isOpen());
+
+    for (size_t i = 0; i < scenarios.size(); i++) {
+        const std::string result = run(scenarios[i], options);
+        out << (i == 0 ? "\n" : ",\n") << result;
+        std::print(std::cout, "{}/{} {}\n", i + 1, scenarios.size(), result);
+    }
+
+    out << "\n]}\n";
+    std::print(std::cout, "Written to {}\n", options.out);
+}
\ No newline at end of file
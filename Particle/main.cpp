@@ -3,11 +3,19 @@
 
 #include "BlueWorld.h"
 #include "Camera.h"
+#include "Generators.h"
 #include "Simulation.h"
 
 #include <chrono>
 #include <iostream>
-#include <random>
+#include <thread>
+
+// Sleeps away what's left of the frame, a frame that took too long doesn't sleep at all
+void waitForNextFrame(std::chrono::milliseconds frameTime, std::chrono::milliseconds duration) {
+    if (duration < frameTime) {
+        std::this_thread::sleep_for(frameTime - duration);
+    }
+}
 
 void pixelTest() {
     constexpr uint16_t windowWidth = 1'000;
@@ -44,8 +52,8 @@ void special_test_collide() {
         sim.step_bruteForce();
         const auto endTime = std::chrono::high_resolution_clock::now();
         const auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(endTime - startTime);
-        sim.setText(std::format("{} FPS", 1000 / duration.count()));
-        std::this_thread::sleep_for(std::chrono::milliseconds(200) - duration);
+        sim.setText(std::format("{} FPS", 1000 / std::max<long long>(1, duration.count())));
+        waitForNextFrame(std::chrono::milliseconds(200), duration);
     }
 }
 
@@ -66,8 +74,8 @@ void special_test_merge() {
         sim.step_bruteForce();
         const auto endTime = std::chrono::high_resolution_clock::now();
         const auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(endTime - startTime);
-        sim.setText(std::format("{} FPS", 1000 / duration.count()));
-        std::this_thread::sleep_for(std::chrono::milliseconds(200) - duration);
+        sim.setText(std::format("{} FPS", 1000 / std::max<long long>(1, duration.count())));
+        waitForNextFrame(std::chrono::milliseconds(200), duration);
     }
 }
 
@@ -88,8 +96,8 @@ void special_test_spin() {
         sim.step_bruteForce();
         const auto endTime = std::chrono::high_resolution_clock::now();
         const auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(endTime - startTime);
-        sim.setText(std::format("{} FPS", 1000 / duration.count()));
-        std::this_thread::sleep_for(std::chrono::milliseconds(200) - duration);
+        sim.setText(std::format("{} FPS", 1000 / std::max<long long>(1, duration.count())));
+        waitForNextFrame(std::chrono::milliseconds(200), duration);
     }
 }
 
@@ -100,31 +108,20 @@ void run_showcase3() {
 
     Simulation sim(Vector2u(windowWidth, windowWidth));
 
-    std::mt19937 mt;
-    std::uniform_real_distribution<double> dice_window_x(-spawnWidth, spawnWidth);
-    std::uniform_real_distribution<double> dice_window_y(-spawnWidth, spawnWidth);
-
-    auto spawner = [&]() {
-        Position pos(dice_window_x(mt), dice_window_y(mt), 0);
-        while (std::hypot(pos.x, pos.y, pos.z) > (spawnWidth / 2.0)) {
-            pos = Position(dice_window_x(mt), dice_window_y(mt), 0);
-        }
-
-        sim.placeParticle(pos, Vector3d(0.0, 0.0, 0.0));
-    };
+    ParticleStream stream(GeneratorSettings{.model = Model::UniformDisk, .radius = spawnWidth / 2.0});
+    sim.reserve(particleCount);
 
     std::string text;
     constexpr size_t particlesPerRound = 10;
     for (int i = 0; i < particleCount;) {
         const auto startTime = std::chrono::high_resolution_clock::now();
-        for (int j = 0; j < particlesPerRound; j++, i++) {
-            spawner();
-        }
+        sim.placeParticles(stream.next(particlesPerRound));
+        i += particlesPerRound;
         sim.step_bruteForce();
         const auto endTime = std::chrono::high_resolution_clock::now();
         const auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(endTime - startTime);
         sim.setText(std::format("{} particle, {}ms", i, duration.count()));
-        std::this_thread::sleep_for(std::chrono::milliseconds(20) - duration);
+        waitForNextFrame(std::chrono::milliseconds(20), duration);
     }
 
     while (true) {
@@ -133,7 +130,7 @@ void run_showcase3() {
         const auto endTime = std::chrono::high_resolution_clock::now();
         const auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(endTime - startTime);
         sim.setText(std::format("{} particle, {}ms", particleCount, duration.count()));
-        std::this_thread::sleep_for(std::chrono::milliseconds(20) - duration);
+        waitForNextFrame(std::chrono::milliseconds(20), duration);
     }
 }
 
@@ -144,32 +141,20 @@ void run_showcase2() {
 
     Simulation sim(Vector2u(windowWidth, windowWidth));
 
-    std::mt19937 mt;
-    std::uniform_real_distribution<double> dice_window_x(-spawnWidth, spawnWidth);
-    std::uniform_real_distribution<double> dice_window_y(-spawnWidth, spawnWidth);
-    std::uniform_real_distribution<double> dice_window_z(-spawnWidth, spawnWidth);
-
-    auto spawner = [&]() {
-        Position pos(dice_window_x(mt), dice_window_y(mt), dice_window_z(mt));
-        while (std::hypot(pos.x, pos.y, pos.z) > (spawnWidth / 2.0)) {
-            pos = Position(dice_window_x(mt), dice_window_y(mt), dice_window_z(mt));
-        }
-
-        sim.placeParticle(pos, Vector3d(0.0, 0.0, 0.0));
-    };
+    ParticleStream stream(GeneratorSettings{.model = Model::UniformBall, .radius = spawnWidth / 2.0});
+    sim.reserve(particleCount);
 
     std::string text;
     constexpr size_t particlesPerRound = 10;
     for (int i = 0; i < particleCount;) {
         const auto startTime = std::chrono::high_resolution_clock::now();
-        for (int j = 0; j < particlesPerRound; j++, i++) {
-            spawner();
-        }
+        sim.placeParticles(stream.next(particlesPerRound));
+        i += particlesPerRound;
         sim.step_bruteForce();
         const auto endTime = std::chrono::high_resolution_clock::now();
         const auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(endTime - startTime);
         sim.setText(std::format("{} particle, {}ms", i, duration.count()));
-        std::this_thread::sleep_for(std::chrono::milliseconds(20) - duration);
+        waitForNextFrame(std::chrono::milliseconds(20), duration);
     }
 
     while (true) {
@@ -178,7 +163,7 @@ void run_showcase2() {
         const auto endTime = std::chrono::high_resolution_clock::now();
         const auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(endTime - startTime);
         sim.setText(std::format("{} particle, {}ms", particleCount, duration.count()));
-        std::this_thread::sleep_for(std::chrono::milliseconds(20) - duration);
+        waitForNextFrame(std::chrono::milliseconds(20), duration);
     }
 }
 
@@ -189,19 +174,8 @@ void run_showcase() {
 
     Simulation sim(Vector2u(windowWidth, windowWidth));
 
-    std::mt19937 mt;
-    std::uniform_real_distribution<double> dice_window_x(-spawnWidth, spawnWidth);
-    std::uniform_real_distribution<double> dice_window_y(-spawnWidth, spawnWidth);
-    std::uniform_real_distribution<double> dice_window_z(-spawnWidth, spawnWidth);
-
-    for (int i = 0; i < particleCount; i++) {
-        Position pos(dice_window_x(mt), dice_window_y(mt), dice_window_z(mt));
-        while (std::hypot(pos.x, pos.y, pos.z) > (spawnWidth / 2.0)) {
-            pos = Position(dice_window_x(mt), dice_window_y(mt), dice_window_z(mt));
-        }
-
-        sim.placeParticle(pos, Vector3d(0.0, 0.0, 0.0));
-    }
+    ParticleStream stream(GeneratorSettings{.model = Model::UniformBall, .radius = spawnWidth / 2.0});
+    sim.placeParticles(stream.next(particleCount));
     std::print(std::cout, "Placed {} particles\n", particleCount);
     std::string text;
     while (true) {
@@ -209,55 +183,25 @@ void run_showcase() {
         sim.step_bruteForce();
         const auto endTime = std::chrono::high_resolution_clock::now();
         const auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(endTime - startTime);
-        sim.setText(std::format("{} FPS", 1000 / duration.count()));
-        std::this_thread::sleep_for(std::chrono::milliseconds(20) - duration);
+        sim.setText(std::format("{} FPS", 1000 / std::max<long long>(1, duration.count())));
+        waitForNextFrame(std::chrono::milliseconds(20), duration);
     }
 }
 
-void run_benchmark() {
-    constexpr size_t particleCount = 100'000;
+// Plays what was recorded with J in any of the scenarios
+void run_replay() {
     constexpr uint16_t windowWidth = 1'000;
-    constexpr uint16_t spawnWidth = windowWidth / 2;
-    constexpr int benchmarkRounds = 1'000;
 
     Simulation sim(Vector2u(windowWidth, windowWidth));
+    sim.openReplay("trajectory.ptraj");
 
-    std::mt19937 mt;
-    std::uniform_real_distribution<double> dice_window_x(-spawnWidth, spawnWidth);
-    std::uniform_real_distribution<double> dice_window_y(-spawnWidth, spawnWidth);
-    std::uniform_real_distribution<double> dice_window_z(-spawnWidth / 10, spawnWidth / 10);
-
-    for (int i = 0; i < particleCount; i++) {
-        Position pos(dice_window_x(mt), dice_window_y(mt), dice_window_z(mt));
-        while (std::hypot(pos.x, pos.y) > (spawnWidth / 2.0)) {
-            pos = Position(dice_window_x(mt), dice_window_y(mt), dice_window_z(mt));
-        }
-
-        sim.placeParticle(pos, Vector3d(0.0, 0.0, 0.0));
-    }
-
-    std::chrono::milliseconds sum(0);
-    std::chrono::milliseconds min(std::chrono::milliseconds::max());
-    std::chrono::milliseconds max(std::chrono::milliseconds::min());
-    for (int i = 0; i < benchmarkRounds; i++) {
+    while (true) {
         const auto startTime = std::chrono::high_resolution_clock::now();
-        sim.step_bruteForce();
+        sim.step_replay();
         const auto endTime = std::chrono::high_resolution_clock::now();
         const auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(endTime - startTime);
-
-        sum += duration;
-        max = std::max(max, duration);
-        min = std::min(min, duration);
-
-        sim.setText(std::format("{}/{} {}\n", i, benchmarkRounds, duration));
+        waitForNextFrame(std::chrono::milliseconds(16), duration);
     }
-
-    std::cout << "Finished!\n";
-    std::print(std::cout, "Total time: {}\n", sum);
-    std::print(std::cout, "Average time: {}\n", sum / benchmarkRounds);
-    std::print(std::cout, "Min time: {}\n", min);
-    std::print(std::cout, "Max time: {}\n", max);
-    std::print(std::cout, "{} | {} | {} | {}\n", sum, sum / benchmarkRounds, min, max);
 }
 
 int main() {
@@ -265,13 +209,13 @@ int main() {
     // special_test_merge();
     special_test_collide();
     // special_test_spin();
-    // run_benchmark();
     // run_showcase2();
     // run_showcase3();
+    // run_replay();
 }
 
 /*
- * Benchmarks:
+ * Benchmarks (particle_bench measures these headless now):
  *                  | Average time | Min round | Max round
  * Single thread    |      30948ms |   30603ms |   31551ms
  * Full multithread |       4383ms |    4214ms |    4719ms